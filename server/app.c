@@ -29,17 +29,31 @@ static bool file_exists(const char *path, bool symlink)
 	return S_ISREG(sb.st_mode);
 }
 
+/* Appends "s" at "*pos" of "path" of the given size. Returns false if it
+ * does not fit. */
+static bool path_add(char *path, size_t size, size_t *pos, const char *s)
+{
+	size_t len;
+
+	len = strlcpy(path + *pos, s, size - *pos);
+	if (len >= size - *pos)
+		return false;
+	*pos += len;
+	return true;
+}
+
 static const struct level_ops *so_get_level(char *code)
 {
 	char path[MAX_PATH_LEN];
-	size_t pos;
+	size_t pos = 0;
 	void *handle;
 	char *err;
 	struct level_ops *ops;
 
-	pos = strlcpy(path, LEVELS_DIR, MAX_PATH_LEN);
-	pos += strlcpy(path + pos, code, MAX_PATH_LEN - pos);
-	pos += strlcpy(path + pos, ".so", MAX_PATH_LEN - pos);
+	if (!path_add(path, MAX_PATH_LEN, &pos, LEVELS_DIR) ||
+	    !path_add(path, MAX_PATH_LEN, &pos, code) ||
+	    !path_add(path, MAX_PATH_LEN, &pos, ".so"))
+		return NULL;
 	if (!file_exists(path, false))
 		return NULL;
 
@@ -70,12 +84,13 @@ static const struct level_ops *py_get_level(char *code)
 {
 	char path[MAX_PYPATH_LEN];
 	char sl[LOGIN_LEN + 3 + 1];
-	size_t pos;
+	size_t pos = 0;
 	ssize_t len;
 
-	pos = strlcpy(path, PYLEVELS_DIR, MAX_PYPATH_LEN);
-	pos += strlcpy(path + pos, "code_", MAX_PYPATH_LEN - pos);
-	pos += strlcpy(path + pos, code, MAX_PYPATH_LEN - pos);
+	if (!path_add(path, MAX_PYPATH_LEN, &pos, PYLEVELS_DIR) ||
+	    !path_add(path, MAX_PYPATH_LEN, &pos, "code_") ||
+	    !path_add(path, MAX_PYPATH_LEN, &pos, code))
+		return NULL;
 	if (!file_exists(path, true))
 		return NULL;
 	len = readlink(path, sl, sizeof(sl));
@@ -87,8 +102,12 @@ static const struct level_ops *py_get_level(char *code)
 		len--;
 	sl[len] = '\0';
 
-	pos = strlcpy(path, PYLEVELS_DIR, MAX_PYPATH_LEN);
-	pos += strlcpy(path + pos, sl, MAX_PYPATH_LEN - pos);
+	pos = 0;
+	if (!path_add(path, MAX_PYPATH_LEN, &pos, PYLEVELS_DIR) ||
+	    !path_add(path, MAX_PYPATH_LEN, &pos, sl)) {
+		log_err("symlink target %s too long", sl);
+		return NULL;
+	}
 	if (!file_exists(path, false)) {
 		log_err("dangling symlink to %s", path);
 		return NULL;
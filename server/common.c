@@ -17,6 +17,10 @@ static bool is_space(char c)
 	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
+/* calls of the system allocator, for statistics */
+static unsigned long alloc_calls;
+static unsigned long free_calls;
+
 static void alloc_err(size_t size)
 {
 	log_err("allocation error, size %zu, errno %d", size, errno);
@@ -27,6 +31,7 @@ void *salloc(size_t size)
 {
 	void *res;
 
+	alloc_calls++;
 	res = malloc(size);
 	if (!res)
 		alloc_err(size);
@@ -37,6 +42,7 @@ void *szalloc(size_t size)
 {
 	void *res;
 
+	alloc_calls++;
 	res = calloc(1, size);
 	if (!res)
 		alloc_err(size);
@@ -47,6 +53,7 @@ void *srealloc(void *ptr, size_t size)
 {
 	void *res;
 
+	alloc_calls++;
 	res = realloc(ptr, size);
 	if (!res)
 		alloc_err(size);
@@ -55,9 +62,86 @@ void *srealloc(void *ptr, size_t size)
 
 void sfree(void *ptr)
 {
+	if (ptr)
+		free_calls++;
 	free(ptr);
 }
 
+/*** Slab pools ***/
+
+#define SLAB_SIZE	16384
+/* the malloc alignment */
+#define SLAB_ALIGN	(2 * sizeof(size_t))
+
+static struct slab_pool *pools;
+
+static void slab_grow(struct slab_pool *p)
+{
+	char *slab;
+
+	if (!p->per_slab) {
+		/* the free list link is stored in the object itself */
+		if (p->size < sizeof(void *))
+			p->size = sizeof(void *);
+		p->size = (p->size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+		p->per_slab = SLAB_SIZE / p->size;
+		if (!p->per_slab)
+			p->per_slab = 1;
+		p->next = pools;
+		pools = p;
+	}
+
+	slab = salloc(p->size * p->per_slab);
+	for (unsigned i = p->per_slab; i > 0; i--) {
+		void **obj = (void **)(slab + (i - 1) * p->size);
+
+		*obj = p->free;
+		p->free = obj;
+	}
+	p->slabs++;
+}
+
+void *slab_alloc(struct slab_pool *p)
+{
+	void **obj;
+
+	if (!p->free)
+		slab_grow(p);
+	obj = p->free;
+	p->free = *obj;
+	p->allocs++;
+	if (++p->in_use > p->peak)
+		p->peak = p->in_use;
+	return obj;
+}
+
+void *slab_zalloc(struct slab_pool *p)
+{
+	void *obj = slab_alloc(p);
+
+	memset(obj, 0, p->size);
+	return obj;
+}
+
+void slab_free(struct slab_pool *p, void *obj)
+{
+	if (!obj)
+		return;
+	*(void **)obj = p->free;
+	p->free = obj;
+	p->in_use--;
+}
+
+void alloc_log_stats(void)
+{
+	log_info("allocator: %lu allocations, %lu frees", alloc_calls,
+		 free_calls);
+	for (struct slab_pool *p = pools; p; p = p->next)
+		log_info("slab %s: %lu in use, peak %lu, %lu allocations, "
+			 "%lu slabs of %u", p->name, p->in_use, p->peak,
+			 p->allocs, p->slabs, p->per_slab);
+}
+
 void rstrip(char *s)
 {
 	size_t pos;
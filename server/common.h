@@ -14,6 +14,30 @@ void *szalloc(size_t size);
 void *srealloc(void *ptr, size_t size);
 void sfree(void *ptr);
 
+/* Slab pools of fixed size objects. Objects are carved out of larger slabs
+ * and kept on a free list when freed; the memory is never returned to the
+ * system. Define a pool with SLAB_POOL(var, type). */
+struct slab_pool {
+	const char *name;
+	size_t size;
+	unsigned per_slab;
+	void *free;
+	unsigned long slabs;
+	unsigned long in_use;
+	unsigned long peak;
+	unsigned long allocs;
+	struct slab_pool *next;
+};
+
+#define SLAB_POOL(var, type)	\
+	static struct slab_pool var = { .name = #type, .size = sizeof(type) }
+
+void *slab_alloc(struct slab_pool *p);
+void *slab_zalloc(struct slab_pool *p);
+void slab_free(struct slab_pool *p, void *obj);
+
+void alloc_log_stats(void);
+
 void rstrip(char *s);
 size_t strlcpy(char *dest, const char *src, size_t size);
 char *sstrdup(const char *s);
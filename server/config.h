@@ -0,0 +1,11 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define INSTALL_DIR	""
+#define DB_PATH	INSTALL_DIR "users"
+#define LEVELS_DIR	INSTALL_DIR "levels/"
+#define PYLEVELS_DIR	INSTALL_DIR "pylevels/"
+#define PLUMBING	INSTALL_DIR "tools/answer.sh"
+#define LOGIN_LEN	30
+
+#endif
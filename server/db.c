@@ -1,5 +1,6 @@
 #include "db.h"
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 #include "common.h"
 #include "config.h"
 #include "event.h"
+#include "ipc.h"
 #include "log.h"
 #include "socket.h"
 #include "spawn.h"
@@ -15,6 +17,10 @@ struct user {
 	char login[LOGIN_LEN + 1];
 	pid_t pid;
 	struct socket *pipe;
+	bool idle;
+	bool evicted;
+	long rss;
+	unsigned long lru;
 	struct user *next;
 };
 
@@ -64,6 +70,16 @@ static struct user *find_pid(struct user *list, pid_t pid)
 	return u;
 }
 
+static struct user *find_pipe(struct user *list, struct socket *pipe)
+{
+	struct user *u;
+
+	for (u = list; u; u = u->next)
+		if (u->pipe == pipe)
+			break;
+	return u;
+}
+
 static bool strip_nl(char *s)
 {
 	int len = strlen(s);
@@ -141,6 +157,9 @@ int db_reload(void)
 				strcpy(u->login, login);
 				u->pid = 0;
 				u->pipe = NULL;
+				u->idle = false;
+				u->evicted = false;
+				u->rss = 0;
 				u->next = NULL;
 				*last = u;
 				last = &u->next;
@@ -169,33 +188,190 @@ int db_init(void)
 	return db_reload();
 }
 
-#define BUF_SIZE 1024
-static void pipe_read(struct socket *s, void *data __unused)
+/*** Admission ***/
+
+/* New children are started only while the number of children and their
+ * total memory are within the limits. Idle children (those without a
+ * bound app socket) are terminated to make room, the least recently used
+ * first. Terminated children count until they exit. */
+
+#define SAMPLE_INTERVAL	1000
+
+static int max_children;
+static unsigned long mem_budget;
+static int children;
+static int evicting;
+static unsigned long mem_used;
+static unsigned long mem_evicting;
+static unsigned long lru_clock;
+static unsigned long evicted_cnt;
+static int sample_timer = -1;
+
+static void set_rss(struct user *u, long rss)
+{
+	if (rss < 0) {
+		log_warn("cannot get memory usage of child [%s:%d]: %s", u->login,
+			 u->pid, strerror(-rss));
+		return;
+	}
+	mem_used += rss - u->rss;
+	if (u->evicted)
+		mem_evicting += rss - u->rss;
+	u->rss = rss;
+}
+
+static struct user *find_idle_lru(struct user *list, struct user *lru)
 {
-	char buf[BUF_SIZE];
-	size_t len;
+	for (struct user *u = list; u; u = u->next)
+		if (u->idle && !u->evicted && u->pid &&
+		    (!lru || u->lru < lru->lru))
+			lru = u;
+	return lru;
+}
 
-	while (true) {
-		len = socket_read(s, buf, BUF_SIZE);
-		log_raw(buf, len);
-		if (!len)
-			break;
+static bool evict_one(void)
+{
+	struct user *u;
+
+	u = find_idle_lru(inactive, find_idle_lru(users, NULL));
+	if (!u)
+		return false;
+	log_info("evicting idle child [%s:%d] (%ld kB)", u->login, u->pid,
+		 u->rss / 1024);
+	kill(u->pid, SIGTERM);
+	u->evicted = true;
+	evicting++;
+	mem_evicting += u->rss;
+	evicted_cnt++;
+	return true;
+}
+
+/* Whether "needed" more children would not fit once the evicted ones
+ * exit. With "needed" 0, whether the current children do not fit. */
+static bool over_limits(int needed)
+{
+	if (max_children && children - evicting + needed > max_children)
+		return true;
+	/* the memory of a new child is not known in advance */
+	return mem_budget &&
+	       mem_used - mem_evicting + (needed ? 1 : 0) > mem_budget;
+}
+
+void db_make_room(int needed)
+{
+	while (over_limits(needed) && evict_one())
+		;
+}
+
+bool db_admit(const char *login)
+{
+	struct user *u;
+
+	u = find_login(users, login);
+	/* a new child can start only once the evicted one is reaped */
+	if (u && u->evicted)
+		return false;
+	if (db_has_child(login))
+		return true;
+	if (max_children && children >= max_children)
+		return false;
+	return !mem_budget || mem_used < mem_budget;
+}
+
+static int sample(int fd __unused, int count __unused, void *data __unused)
+{
+	for (struct user *u = users; u; u = u->next)
+		if (u->pid)
+			set_rss(u, spawn_get_rss(u->pid));
+	for (struct user *u = inactive; u; u = u->next)
+		if (u->pid)
+			set_rss(u, spawn_get_rss(u->pid));
+	db_make_room(ipc_waiting_count());
+	ipc_admit_waiting();
+	return 0;
+}
+
+int db_set_limits(int max_children_, unsigned long mem_budget_)
+{
+	max_children = max_children_;
+	mem_budget = mem_budget_;
+	if (!mem_budget)
+		return 0;
+	sample_timer = timer_new(sample, NULL, NULL);
+	if (sample_timer < 0)
+		return sample_timer;
+	return timer_arm(sample_timer, SAMPLE_INTERVAL, true);
+}
+
+void db_child_idle(struct socket *pipe, bool idle)
+{
+	struct user *u;
+
+	u = find_pipe(users, pipe);
+	if (!u)
+		u = find_pipe(inactive, pipe);
+	if (!u) {
+		log_err("idle state reported by an unknown child");
+		return;
 	}
+	u->idle = idle;
+	if (!idle || !u->pid)
+		return;
+	set_rss(u, spawn_get_rss(u->pid));
+	/* the waiting logins may get this child's place */
+	db_make_room(ipc_waiting_count());
+}
+
+void db_log_stats(void)
+{
+	if (!db_inited)
+		return;
+	log_info("children: %d (limit %d), %lu kB used (budget %lu kB), %d being evicted, %lu evicted",
+		 children, max_children, mem_used / 1024, mem_budget / 1024,
+		 evicting, evicted_cnt);
 }
 
-void db_start_process(const char *login, pid_t pid, int pipefd)
+void db_start_process(const char *login, pid_t pid, struct socket *pipe)
 {
 	struct user *u;
 
 	u = find_login(users, login);
 	if (!u) {
 		log_err("unknown login '%s' reported as started", login);
+		socket_del(pipe);
+		socket_unref(pipe);
 		return;
 	}
 	u->pid = pid;
-	u->pipe = socket_add(pipefd, pipe_read, NULL, NULL);
-	socket_ref(u->pipe);
-	log_info("child [%s:%d] started with pipe fd %d", login, pid, pipefd);
+	u->pipe = pipe;
+	u->idle = false;
+	u->evicted = false;
+	/* an estimate until sampled */
+	u->rss = children ? mem_used / children : 0;
+	mem_used += u->rss;
+	children++;
+	u->lru = ++lru_clock;
+	if (pid)
+		log_info("child [%s:%d] started with pipe fd %d", login, pid,
+			 socket_get_fd(pipe));
+	else
+		log_info("child [%s] starting with pipe fd %d", login,
+			 socket_get_fd(pipe));
+}
+
+void db_set_pid(const char *login, pid_t pid)
+{
+	struct user *u;
+
+	u = find_login(users, login);
+	if (!u)
+		u = find_login(inactive, login);
+	if (!u || !u->pipe || u->pid) {
+		log_err("unexpected pid %d reported for '%s'", pid, login);
+		return;
+	}
+	u->pid = pid;
+	log_info("child [%s:%d] started", login, pid);
 }
 
 void db_end_process(pid_t pid)
@@ -213,7 +389,15 @@ void db_end_process(pid_t pid)
 	socket_unref(u->pipe);
 	u->pid = 0;
 	u->pipe = NULL;
+	children--;
+	mem_used -= u->rss;
+	if (u->evicted) {
+		evicting--;
+		mem_evicting -= u->rss;
+		u->evicted = false;
+	}
 	log_info("child [%s:%d] terminated", u->login, pid);
+	ipc_admit_waiting();
 }
 
 bool db_user_exists(const char *login)
@@ -221,14 +405,24 @@ bool db_user_exists(const char *login)
 	return !!find_login(users, login);
 }
 
+bool db_has_child(const char *login)
+{
+	struct user *u;
+
+	u = find_login(users, login);
+	/* an evicted child is going away and takes no new connections */
+	return u && u->pipe && !u->evicted;
+}
+
 struct socket *db_get_pipe(const char *login)
 {
 	struct user *u;
 
 	u = find_login(users, login);
-	if (!u)
+	if (!u || u->evicted)
 		return NULL;
 	if (!u->pipe)
 		spawn(login);
+	u->lru = ++lru_clock;
 	return u->pipe;
 }
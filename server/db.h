@@ -6,9 +6,26 @@
 
 int db_init(void);
 int db_reload(void);
-void db_start_process(const char *login, pid_t pid, int pipefd);
+/* "pid" may be 0 if not known yet, it is then set by db_set_pid. The pipe
+ * reference is taken over. */
+void db_start_process(const char *login, pid_t pid, struct socket *pipe);
+void db_set_pid(const char *login, pid_t pid);
 void db_end_process(pid_t pid);
 bool db_user_exists(const char *login);
+bool db_has_child(const char *login);
 struct socket *db_get_pipe(const char *login);
 
+/* Sets the maximum number of children and their total memory in bytes, 0
+ * for no limit. */
+int db_set_limits(int max_children, unsigned long mem_budget);
+/* Whether the login has a child or a new one may be started now. A login
+ * whose child is being evicted is not admitted until the child exits. */
+bool db_admit(const char *login);
+/* Terminates idle children, the least recently used first, so that
+ * "needed" more children fit into the limits once they exit. */
+void db_make_room(int needed);
+/* To be called when the child on the pipe reports its idle state. */
+void db_child_idle(struct socket *pipe, bool idle);
+void db_log_stats(void);
+
 #endif
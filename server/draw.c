@@ -21,6 +21,7 @@ static int x_start, y_start;
 static unsigned char fixed[(DRAW_MOD_WIDTH + 1) * (DRAW_MOD_HEIGHT + 1)];
 static struct sprite *floating;
 static struct sprite **floating_last;
+SLAB_POOL(sprite_pool, struct sprite);
 
 #define fixed_coords(x, y)	((y) * (DRAW_MOD_WIDTH + 1) + (x))
 
@@ -152,7 +153,7 @@ void draw_clear(void)
 	while (floating) {
 		struct sprite *next = floating->next;
 
-		sfree(floating);
+		slab_free(&sprite_pool, floating);
 		floating = next;
 	}
 	floating_last = &floating;
@@ -179,7 +180,7 @@ void draw_item(int x, int y, unsigned angle, unsigned color)
 		fixed[fixed_coords(x / DRAW_MOD, y / DRAW_MOD)] = color;
 		return;
 	}
-	p = salloc(sizeof(*p));
+	p = slab_alloc(&sprite_pool);
 	p->x = x + DRAW_MOD;	/* this is never negative */
 	p->y = y + DRAW_MOD;
 	p->angle = angle / 3;
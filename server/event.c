@@ -6,22 +6,35 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/io_uring.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include "common.h"
 #include "db.h"
+#include "ipc.h"
 #include "log.h"
+#include "socket.h"
 #include "spawn.h"
 #include "time.h"
 
 struct fd_data {
 	int fd;
+	uint32_t gen;
+	/* the requested state */
 	unsigned events;
 	bool enabled;
+	bool paused;
+	/* the state registered in the kernel */
+	unsigned kernel_events;
+	bool registered;
+	/* queued for event_flush_changes */
+	bool dirty;
 	event_callback_t cb;
 	void *cb_data;
 	cb_data_destructor_t cb_destructor;
@@ -29,26 +42,58 @@ struct fd_data {
 };
 
 struct timer_data {
+	int id;
 	timer_callback_t cb;
 	void *cb_data;
 	cb_data_destructor_t cb_destructor;
-	struct itimerspec resume_time;
+	uint64_t expires;
+	int interval;
+	uint64_t resume_left;
 	int resume_backlog;
 	bool armed;
 	bool paused;
+	/* wheel level, -1 when on the expired list */
+	signed char level;
+	unsigned char slot;
+	struct timer_data *next, **pprev;
 };
 
 static int epfd;
 static int sigfd;
+static int timerfd;
 static pid_t ignored_pid;
 static bool quit;
 
-#define FDD_HASH_SIZE	256
-static struct fd_data *fdd_hash[FDD_HASH_SIZE];
-
-#define hash(v)		((v) % FDD_HASH_SIZE)
+/* Registered fds, indexed by fd. Each registration gets a new generation
+ * number which is stored together with the fd in the epoll data. This way,
+ * events for an fd that was deleted (and possibly reused) while processing
+ * the current batch of events are detected and dropped. */
+static struct fd_data **fdd_table;
+static int fdd_table_size;
+static uint32_t fdd_gen;
 
 static struct fd_data *deleted = NULL;
+SLAB_POOL(fdd_pool, struct fd_data);
+
+/* Keys (see fdd_key) of fds with changed interest. The changes are applied
+ * to the kernel in one go right before waiting for events. */
+static uint64_t *changed;
+static int changed_cnt;
+static int changed_size;
+
+static int timers_init(void);
+static int timers_program(void);
+static int timers_run(void);
+static uint64_t wheel_now(void);
+static uint64_t wheel_next(void);
+
+static void event_change_fd_data(struct fd_data *fdd);
+
+static bool use_uring;
+static int uring_init(void);
+static int uring_sync_fd_data(struct fd_data *fdd, unsigned events);
+static int uring_del_fd_data(struct fd_data *fdd);
+static int uring_run(void);
 
 static int sig_handler(int fd, unsigned events __unused, void *data __unused)
 {
@@ -62,6 +107,14 @@ static int sig_handler(int fd, unsigned events __unused, void *data __unused)
 			break;
 		case SIGHUP:
 			db_reload();
+			spawn_signal_workers(SIGHUP);
+			break;
+		case SIGUSR1:
+			spawn_log_stats();
+			db_log_stats();
+			ipc_log_stats();
+			socket_log_stats();
+			alloc_log_stats();
 			break;
 		case SIGCHLD: ;
 			int status;
@@ -80,7 +133,7 @@ static int sig_handler(int fd, unsigned events __unused, void *data __unused)
 				if (pid == ignored_pid)
 					ignored_pid = 0;
 				else
-					db_end_process(pid);
+					spawn_child_exited(pid, status);
 			}
 			break;
 		}
@@ -88,17 +141,33 @@ static int sig_handler(int fd, unsigned events __unused, void *data __unused)
 	return 0;
 }
 
-int event_init(void)
+int event_init(bool uring)
 {
 	sigset_t sigs;
 	int ret;
 
-	memset(fdd_hash, 0, sizeof(fdd_hash));
+	fdd_table = NULL;
+	fdd_table_size = 0;
+	fdd_gen = 0;
+	changed = NULL;
+	changed_cnt = 0;
+	changed_size = 0;
 	ignored_pid = 0;
 
-	epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0)
-		return -errno;
+	use_uring = false;
+	if (uring) {
+		ret = uring_init();
+		if (ret < 0)
+			log_warn("cannot use io_uring, falling back to epoll: %s (%d)",
+				 strerror(-ret), -ret);
+		else
+			use_uring = true;
+	}
+	if (!use_uring) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			return -errno;
+	}
 	sigemptyset(&sigs);
 	sigaddset(&sigs, SIGCHLD);
 	sigaddset(&sigs, SIGINT);
@@ -110,112 +179,192 @@ int event_init(void)
 		return -errno;
 	sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
 	ret = event_add_fd(sigfd, EV_READ, sig_handler, NULL, NULL);
-	return ret;
+	if (ret < 0)
+		return ret;
+	return timers_init();
+}
+
+/* The lowest bit is clear, it tags event_op requests in io_uring. */
+static uint64_t fdd_key(struct fd_data *fdd)
+{
+	return (uint64_t)fdd->gen << 32 | (uint32_t)fdd->fd << 1;
+}
+
+static struct fd_data *find_event(int fd)
+{
+	if (fd < 0 || fd >= fdd_table_size)
+		return NULL;
+	return fdd_table[fd];
+}
+
+static struct fd_data *find_event_key(uint64_t key)
+{
+	struct fd_data *fdd = find_event((uint32_t)key >> 1);
+
+	if (!fdd || fdd->gen != key >> 32)
+		/* stale event */
+		return NULL;
+	return fdd;
+}
+
+static void fdd_table_grow(int fd)
+{
+	int size = fdd_table_size ? fdd_table_size : 64;
+
+	while (size <= fd)
+		size *= 2;
+	fdd_table = srealloc(fdd_table, size * sizeof(*fdd_table));
+	memset(fdd_table + fdd_table_size, 0,
+	       (size - fdd_table_size) * sizeof(*fdd_table));
+	fdd_table_size = size;
 }
 
 int event_add_fd(int fd, unsigned events, event_callback_t cb, void *cb_data,
 		 cb_data_destructor_t cb_destructor)
 {
-	struct fd_data *fdd, **ptr;
+	struct fd_data *fdd;
 	struct epoll_event e;
 
-	fdd = salloc(sizeof(*fdd));
+	if (fd < 0)
+		return -EBADF;
+	if (fd >= fdd_table_size)
+		fdd_table_grow(fd);
+	if (fdd_table[fd])
+		return -EEXIST;
+
+	fdd = slab_alloc(&fdd_pool);
 	fdd->fd = fd;
+	fdd->gen = ++fdd_gen;
 	fdd->events = events;
 	fdd->enabled = true;
+	fdd->paused = false;
+	fdd->kernel_events = events;
+	fdd->registered = true;
+	fdd->dirty = false;
 	fdd->cb = cb;
 	fdd->cb_data = cb_data;
 	fdd->cb_destructor = cb_destructor;
 	fdd->next = NULL;
 
+	if (use_uring) {
+		/* armed in event_flush_changes */
+		fdd->registered = false;
+		fdd_table[fd] = fdd;
+		event_change_fd_data(fdd);
+		return 0;
+	}
+
 	e.events = events;
-	e.data.ptr = fdd;
+	e.data.u64 = fdd_key(fdd);
 
 	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
-		sfree(fdd);
-		return -errno;
+		int ret = -errno;
+
+		slab_free(&fdd_pool, fdd);
+		return ret;
 	}
 
-	for (ptr = &fdd_hash[hash(fd)]; *ptr; ptr = &(*ptr)->next)
-		;
-	*ptr = fdd;
+	fdd_table[fd] = fdd;
 	return 0;
 }
 
 int event_del_fd(int fd)
 {
-	struct fd_data *fdd, **ptr;
+	struct fd_data *fdd;
 	int ret = 0;
 
-	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
-		ret = -errno;
+	fdd = find_event(fd);
+	if (use_uring) {
+		/* The cancellation is submitted together with the next
+		 * wait, the poll request holds its own file reference. */
+		if (fdd && fdd->registered)
+			ret = uring_del_fd_data(fdd);
+	} else if (!fdd || fdd->registered) {
+		/* This has to be done right away, the fd may be passed to
+		 * another process before it is closed. */
+		if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+			ret = -errno;
+	}
 
-	for (ptr = &fdd_hash[hash(fd)]; *ptr && (*ptr)->fd != fd; ptr = &(*ptr)->next)
-		;
-	fdd = *ptr;
 	if (fdd) {
-		*ptr = fdd->next;
+		fdd_table[fd] = NULL;
 		fdd->next = deleted;
 		deleted = fdd;
 	}
 	return ret;
 }
 
-static struct fd_data *find_event(int fd)
-{
-	struct fd_data *fdd;
-
-	for (fdd = fdd_hash[hash(fd)]; fdd && fdd->fd != fd; fdd = fdd->next)
-		;
-	return fdd;
-}
-
-static void *find_cb_data(int fd)
+/* Only records the change, see event_flush_changes. */
+static void event_change_fd_data(struct fd_data *fdd)
 {
-	struct fd_data *fdd = find_event(fd);
-
-	if (fdd)
-		return fdd->cb_data;
-	return NULL;
+	if (fdd->dirty)
+		return;
+	if (changed_cnt == changed_size) {
+		changed_size = changed_size ? 2 * changed_size : 64;
+		changed = srealloc(changed, changed_size * sizeof(*changed));
+	}
+	changed[changed_cnt++] = fdd_key(fdd);
+	fdd->dirty = true;
 }
 
-/* enable values: 1 to add to the poll set, 0 to remove, -1 to change, -2 to
- * change to listen for errors only */
-static int event_change_fd_data(struct fd_data *fdd, int enable)
+static int event_sync_fd_data(struct fd_data *fdd)
 {
 	struct epoll_event e;
 	int op;
 
+	fdd->dirty = false;
+	e.events = fdd->events;
+	if (fdd->paused)
+		e.events &= EV_ERROR;
+	if (use_uring)
+		return uring_sync_fd_data(fdd, e.events);
+	e.data.u64 = fdd_key(fdd);
+
 	if (!fdd->enabled) {
-		if (enable > 0)
-			op = EPOLL_CTL_ADD;
-		else
+		if (!fdd->registered)
 			return 0;
+		op = EPOLL_CTL_DEL;
+	} else if (!fdd->registered) {
+		op = EPOLL_CTL_ADD;
 	} else {
-		if (enable > 0)
+		if (e.events == fdd->kernel_events)
 			return 0;
-		op = enable < 0 ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+		op = EPOLL_CTL_MOD;
 	}
 
-	e.events = fdd->events;
-	if (enable == -2)
-		e.events &= EV_ERROR;
-	e.data.ptr = fdd;
-
 	if (epoll_ctl(epfd, op, fdd->fd, &e) < 0)
 		return -errno;
-	if (enable >= 0)
-		fdd->enabled = enable;
+	fdd->registered = fdd->enabled;
+	fdd->kernel_events = e.events;
 	return 0;
 }
 
+static void event_flush_changes(void)
+{
+	for (int i = 0; i < changed_cnt; i++) {
+		struct fd_data *fdd = find_event_key(changed[i]);
+		int ret;
+
+		if (!fdd)
+			/* deleted in the meantime */
+			continue;
+		ret = event_sync_fd_data(fdd);
+		if (ret < 0)
+			log_warn("cannot change events of fd %d: %s (%d)",
+				 fdd->fd, strerror(-ret), -ret);
+	}
+	changed_cnt = 0;
+}
+
 int event_enable_fd(int fd, bool enable)
 {
 	struct fd_data *fdd = find_event(fd);
 
 	if (!fdd)
 		return -ENOENT;
-	return event_change_fd_data(fdd, (int)enable);
+	fdd->enabled = enable;
+	event_change_fd_data(fdd);
+	return 0;
 }
 
 int event_pause_fd(int fd, bool pause)
@@ -224,7 +373,9 @@ int event_pause_fd(int fd, bool pause)
 
 	if (!fdd)
 		return -ENOENT;
-	return event_change_fd_data(fdd, pause ? -2 : -1);
+	fdd->paused = pause;
+	event_change_fd_data(fdd);
+	return 0;
 }
 
 int event_change_fd(int fd, unsigned events)
@@ -234,7 +385,8 @@ int event_change_fd(int fd, unsigned events)
 	if (!fdd)
 		return -ENOENT;
 	fdd->events = events;
-	return event_change_fd_data(fdd, -1);
+	event_change_fd_data(fdd);
+	return 0;
 }
 
 int event_change_fd_add(int fd, unsigned events)
@@ -244,7 +396,8 @@ int event_change_fd_add(int fd, unsigned events)
 	if (!fdd)
 		return -ENOENT;
 	fdd->events |= events;
-	return event_change_fd_data(fdd, -1);
+	event_change_fd_data(fdd);
+	return 0;
 }
 
 int event_change_fd_remove(int fd, unsigned events)
@@ -254,7 +407,8 @@ int event_change_fd_remove(int fd, unsigned events)
 	if (!fdd)
 		return -ENOENT;
 	fdd->events &= ~events;
-	return event_change_fd_data(fdd, -1);
+	event_change_fd_data(fdd);
+	return 0;
 }
 
 void event_ignore_pid(pid_t pid)
@@ -262,15 +416,44 @@ void event_ignore_pid(pid_t pid)
 	ignored_pid = pid;
 }
 
+/* Deferred calls */
+
+#define DEFERRED_MAX	16
+
+static struct {
+	event_defer_cb_t cb;
+	void *data;
+} deferred[DEFERRED_MAX];
+static int deferred_cnt;
+
+int event_defer(event_defer_cb_t cb, void *data)
+{
+	if (deferred_cnt >= DEFERRED_MAX)
+		return -ENOBUFS;
+	deferred[deferred_cnt].cb = cb;
+	deferred[deferred_cnt].data = data;
+	deferred_cnt++;
+	return 0;
+}
+
+static void run_deferred(void)
+{
+	/* calls deferred from the callbacks are run as well */
+	for (int i = 0; i < deferred_cnt; i++)
+		deferred[i].cb(deferred[i].data);
+	deferred_cnt = 0;
+}
+
 static void release_deleted(void)
 {
 	while (deleted) {
-		struct fd_data *next = deleted->next;
+		struct fd_data *fdd = deleted;
 
-		if (deleted->cb_destructor)
-			deleted->cb_destructor(deleted->cb_data);
-		sfree(deleted);
-		deleted = next;
+		/* unlink first, the destructor may delete other fds */
+		deleted = fdd->next;
+		if (fdd->cb_destructor)
+			fdd->cb_destructor(fdd->cb_data);
+		slab_free(&fdd_pool, fdd);
 	}
 }
 
@@ -284,10 +467,19 @@ int event_loop(void)
 
 	quit = false;
 	while (!ret && !quit) {
+		run_deferred();
 		release_deleted();
 		/* re-check as a destructor may have called event_quit */
 		if (quit)
 			break;
+		event_flush_changes();
+		if (use_uring) {
+			ret = uring_run();
+			continue;
+		}
+		ret = timers_program();
+		if (ret < 0)
+			break;
 		time_flush_cache();
 		cnt = epoll_wait(epfd, evbuf, EVENTS_MAX, -1);
 		if (cnt < 0) {
@@ -297,13 +489,20 @@ int event_loop(void)
 			break;
 		}
 		for (int i = 0; i < cnt; i++) {
-			struct fd_data *fdd = evbuf[i].data.ptr;
+			struct fd_data *fdd = find_event_key(evbuf[i].data.u64);
 
+			if (!fdd)
+				continue;
 			ret = fdd->cb(fdd->fd, evbuf[i].events, fdd->cb_data);
 			if (ret < 0)
 				break;
 		}
 	}
+	if (use_uring && !ret) {
+		/* submit the writes queued by the last callbacks */
+		run_deferred();
+		event_submit();
+	}
 	return ret;
 }
 
@@ -312,131 +511,717 @@ void event_quit(void)
 	quit = true;
 }
 
-static int timer_get_count(int fd)
+/*** Timers ***/
+
+/* All timers share a single timerfd. Armed timers are kept in a
+ * hierarchical timing wheel with a one milisecond tick: level 0 holds the
+ * timers expiring in the next WHEEL_SIZE ticks, each next level has the same
+ * number of slots but covers WHEEL_SIZE times longer period. When a lower
+ * level wraps around, the current slot of the level above is cascaded down.
+ * Arming and disarming a timer is thus only a list operation; the timerfd
+ * is reprogrammed to the nearest event at most once per loop iteration. */
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN	((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_NEVER	UINT64_MAX
+
+static struct timer_data *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_used[WHEEL_LEVELS];
+/* the next tick to be processed */
+static uint64_t wheel_clk;
+/* the tick the timerfd is currently set to */
+static uint64_t wheel_programmed;
+
+/* timers that expired in the current tick batch, in order */
+static struct timer_data *expired;
+static struct timer_data **expired_last;
+
+static struct timer_data **timers;
+static int timers_size;
+static int timers_hint;
+SLAB_POOL(timer_pool, struct timer_data);
+
+static uint64_t wheel_now(void)
 {
-	uint64_t val;
+	struct timespec *now = time_now();
 
-	val = 0;
-	read(fd, &val, sizeof(val));
-	if (val > INT_MAX)
-		val = INT_MAX;
-	return val;
+	return (uint64_t)now->tv_sec * 1000 + now->tv_nsec / 1000000;
+}
+
+static struct timer_data *find_timer(int id)
+{
+	if (id < 0 || id >= timers_size)
+		return NULL;
+	return timers[id];
+}
+
+static void timer_link(struct timer_data **head, struct timer_data *td)
+{
+	td->next = *head;
+	if (td->next)
+		td->next->pprev = &td->next;
+	td->pprev = head;
+	*head = td;
+}
+
+static void timer_unlink(struct timer_data *td)
+{
+	if (!td->pprev)
+		return;
+	if (td->level < 0 && expired_last == &td->next)
+		expired_last = td->pprev;
+	*td->pprev = td->next;
+	if (td->next)
+		td->next->pprev = td->pprev;
+	if (td->level >= 0 && !wheel[td->level][td->slot])
+		wheel_used[td->level] &= ~((uint64_t)1 << td->slot);
+	td->next = NULL;
+	td->pprev = NULL;
+}
+
+static void wheel_insert(struct timer_data *td)
+{
+	uint64_t expires = td->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < wheel_clk)
+		expires = wheel_clk;
+	delta = expires - wheel_clk;
+	if (delta >= WHEEL_SPAN) {
+		/* too far in the future; will be cascaded again */
+		expires = wheel_clk + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+	for (level = 0; delta >> ((level + 1) * WHEEL_BITS); level++)
+		;
+	td->level = level;
+	td->slot = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	timer_link(&wheel[level][td->slot], td);
+	wheel_used[level] |= (uint64_t)1 << td->slot;
 }
 
-static int timer_cb(int fd, unsigned events, void *data)
+/* Returns the nearest tick at which a timer expires or at which a slot
+ * containing timers needs to be cascaded. */
+static uint64_t wheel_next(void)
 {
-	struct timer_data *td = data;
-	int count;
+	uint64_t res = WHEEL_NEVER;
+
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned shift = level * WHEEL_BITS;
+		uint64_t used = wheel_used[level];
+		uint64_t base, t;
+		unsigned idx;
+
+		if (!used)
+			continue;
+		/* the first slot of this level not processed yet */
+		base = (wheel_clk + ((uint64_t)1 << shift) - 1) >> shift;
+		idx = base & WHEEL_MASK;
+		if (idx)
+			used = used >> idx | used << (WHEEL_SIZE - idx);
+		t = (base + __builtin_ctzll(used)) << shift;
+		if (t < res)
+			res = t;
+	}
+	return res;
+}
+
+static void wheel_cascade(int level)
+{
+	unsigned slot = (wheel_clk >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	struct timer_data *td = wheel[level][slot];
+
+	wheel[level][slot] = NULL;
+	wheel_used[level] &= ~((uint64_t)1 << slot);
+	while (td) {
+		struct timer_data *next = td->next;
+
+		td->pprev = NULL;
+		wheel_insert(td);
+		td = next;
+	}
+}
+
+/* Moves all timers expired up to 'now' (inclusive) to the expired list. */
+static void wheel_advance(uint64_t now)
+{
+	while (true) {
+		uint64_t next = wheel_next();
+		unsigned idx;
+		struct timer_data *td;
+
+		if (next > now) {
+			wheel_clk = now + 1;
+			break;
+		}
+		wheel_clk = next;
+		idx = wheel_clk & WHEEL_MASK;
+		if (!idx) {
+			for (int level = 1; level < WHEEL_LEVELS; level++) {
+				wheel_cascade(level);
+				if ((wheel_clk >> (level * WHEEL_BITS)) & WHEEL_MASK)
+					break;
+			}
+		}
+		while ((td = wheel[0][idx])) {
+			timer_unlink(td);
+			td->level = -1;
+			timer_link(expired_last, td);
+			expired_last = &td->next;
+		}
+		wheel_clk++;
+	}
+}
+
+/* Handles expiration of the given (already unlinked) timer. Repeating
+ * timers are rescheduled. Returns the number of expirations. */
+static int timer_expire(struct timer_data *td, uint64_t now)
+{
+	uint64_t count = 1;
+
+	if (!td->interval) {
+		td->armed = false;
+		return 1;
+	}
+	count += (now - td->expires) / td->interval;
+	td->expires += count * td->interval;
+	wheel_insert(td);
+	if (count > INT_MAX)
+		count = INT_MAX;
+	return count;
+}
+
+static int timers_run(void)
+{
+	uint64_t now = wheel_now();
+
+	wheel_advance(now);
+	while (expired) {
+		struct timer_data *td = expired;
+		int count, ret;
+
+		timer_unlink(td);
+		count = timer_expire(td, now);
+		/* the callback may delete the timer, do not touch it
+		 * afterwards */
+		ret = td->cb(td->id, count, td->cb_data);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int timerfd_cb(int fd, unsigned events, void *data __unused)
+{
+	uint64_t val;
 
 	if (!(events & EV_READ))
 		return 0;
-	count = timer_get_count(fd);
-	if (!td->armed)
-		return 0;
-	if (td->paused) {
-		td->resume_backlog += count;
+	read(fd, &val, sizeof(val));
+	wheel_programmed = WHEEL_NEVER;
+	return timers_run();
+}
+
+static int timers_program(void)
+{
+	uint64_t next = wheel_next();
+	struct itimerspec its;
+
+	if (next == wheel_programmed)
 		return 0;
+	memset(&its, 0, sizeof(its));
+	if (next != WHEEL_NEVER) {
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = next % 1000 * 1000000;
+		if (!next)
+			/* all zeroes would disarm the timerfd */
+			its.it_value.tv_nsec = 1;
 	}
-	return td->cb(fd, count, td->cb_data);
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -errno;
+	wheel_programmed = next;
+	return 0;
 }
 
-static void timer_destructor(void *data)
+static int timers_init(void)
 {
-	struct timer_data *td = data;
-
-	if (td->cb_destructor)
-		td->cb_destructor(td->cb_data);
-	free(td);
+	memset(wheel, 0, sizeof(wheel));
+	memset(wheel_used, 0, sizeof(wheel_used));
+	wheel_clk = wheel_now();
+	wheel_programmed = WHEEL_NEVER;
+	expired = NULL;
+	expired_last = &expired;
+	timers = NULL;
+	timers_size = 0;
+	timers_hint = 0;
+
+	if (use_uring)
+		/* the nearest expiration is passed to io_uring_enter */
+		return 0;
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd < 0)
+		return -errno;
+	return event_add_fd(timerfd, EV_READ, timerfd_cb, NULL, NULL);
 }
 
 int timer_new(timer_callback_t cb, void *cb_data,
 	      cb_data_destructor_t cb_destructor)
 {
 	struct timer_data *td;
-	int fd;
-	int ret;
+	int id;
+
+	for (id = timers_hint; id < timers_size && timers[id]; id++)
+		;
+	if (id == timers_size) {
+		int size = timers_size ? 2 * timers_size : 16;
+
+		timers = srealloc(timers, size * sizeof(*timers));
+		memset(timers + timers_size, 0,
+		       (size - timers_size) * sizeof(*timers));
+		timers_size = size;
+	}
+	timers_hint = id + 1;
 
-	td = szalloc(sizeof(*td));
+	td = slab_zalloc(&timer_pool);
+	td->id = id;
 	td->cb = cb;
 	td->cb_data = cb_data;
 	td->cb_destructor = cb_destructor;
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (fd < 0) {
-		free(td);
-		return -errno;
-	}
-	ret = event_add_fd(fd, EV_READ, timer_cb, td, timer_destructor);
-	if (ret < 0) {
-		free(td);
-		close(fd);
-		return ret;
-	}
-	return fd;
+	timers[id] = td;
+	return id;
 }
 
-int timer_arm(int fd, int milisecs, bool repeat)
+int timer_arm(int id, int milisecs, bool repeat)
 {
-	struct timer_data *td = find_cb_data(fd);
-	struct itimerspec its;
+	struct timer_data *td = find_timer(id);
 
-	if (td) {
-		td->armed = !!milisecs;
-		td->paused = false;
+	if (!td || milisecs < 0)
+		return -EINVAL;
+	timer_unlink(td);
+	td->armed = !!milisecs;
+	td->paused = false;
+	if (td->armed) {
+		td->expires = wheel_now() + milisecs;
+		td->interval = repeat ? milisecs : 0;
+		wheel_insert(td);
 	}
-
-	memset(&its, 0, sizeof(its));
-	time_add(&its.it_value, milisecs);
-	if (repeat)
-		time_add(&its.it_interval, milisecs);
-	if (timerfd_settime(fd, 0, &its, NULL) < 0)
-		return -errno;
 	return 0;
 }
 
-int timer_disarm(int fd)
+int timer_disarm(int id)
 {
-	return timer_arm(fd, 0, false);
+	return timer_arm(id, 0, false);
 }
 
-int timer_pause(int fd)
+int timer_pause(int id)
 {
-	struct timer_data *td = find_cb_data(fd);
-	struct itimerspec its;
+	struct timer_data *td = find_timer(id);
+	uint64_t now;
 
-	if (!fd)
+	if (!td)
 		return -EINVAL;
 	if (td->paused)
 		return 0;
-	memset(&its, 0, sizeof(its));
-	if (timerfd_settime(fd, 0, &its, &td->resume_time) < 0)
-		return -errno;
 	td->resume_backlog = 0;
+	if (td->armed) {
+		now = wheel_now();
+		timer_unlink(td);
+		if (td->expires <= now) {
+			/* already scheduled, fire it on resume */
+			td->resume_backlog = timer_expire(td, now);
+			timer_unlink(td);
+		}
+		if (td->armed)
+			td->resume_left = td->expires - now;
+	}
 	td->paused = true;
 	return 0;
 }
 
-int timer_resume(int fd)
+int timer_resume(int id)
 {
-	struct timer_data *td = find_cb_data(fd);
+	struct timer_data *td = find_timer(id);
+	int backlog;
 
-	if (!fd)
+	if (!td)
 		return -EINVAL;
 	if (!td->paused)
 		return 0;
-	if (timerfd_settime(fd, 0, &td->resume_time, NULL) < 0)
-		return -errno;
 	td->paused = false;
-	if (td->resume_backlog)
-		return td->cb(fd, td->resume_backlog, td->cb_data);
+	if (td->armed) {
+		td->expires = wheel_now() + td->resume_left;
+		wheel_insert(td);
+	}
+	backlog = td->resume_backlog;
+	td->resume_backlog = 0;
+	if (backlog)
+		return td->cb(id, backlog, td->cb_data);
 	return 0;
 }
 
-int timer_del(int fd)
+int timer_del(int id)
 {
-	int res;
+	struct timer_data *td = find_timer(id);
 
-	timer_disarm(fd);
-	res = event_del_fd(fd);
-	close(fd);
-	return res;
+	if (!td)
+		return -EINVAL;
+	timer_unlink(td);
+	timers[id] = NULL;
+	if (id < timers_hint)
+		timers_hint = id;
+	if (td->cb_destructor)
+		td->cb_destructor(td->cb_data);
+	slab_free(&timer_pool, td);
+	return 0;
+}
+
+/*** io_uring backend ***/
+
+/* The socket layer does its own I/O through completions, see event_op.
+ * The other fds (the signalfd, pipes and sockets with message boundaries
+ * carrying fds) are watched by one shot poll requests, which give the same
+ * level triggered semantics as epoll (multishot poll requests are edge
+ * triggered). Poll requests are armed and cancelled by
+ * event_flush_changes (and re-armed after they fire); the whole batch is
+ * submitted by the same io_uring_enter call that waits for completions and
+ * for the nearest timer. The fd generation is bumped on each arm,
+ * completions of cancelled requests are thus dropped as stale. */
+
+#define URING_ENTRIES	256
+/* the user data of event_op requests has the lowest bit set */
+#define URING_OP	1
+
+/* Provided buffers for receives. A buffer is returned to the ring as soon
+ * as its data are copied to the socket's input buffer. */
+#define URING_BUF_GROUP	0
+#define URING_BUF_CNT	32
+#define URING_BUF_SIZE	2048
+
+static int ring_fd;
+static struct io_uring_sqe *sqes;
+static unsigned *sq_head, *sq_tail, sq_mask, *sq_array;
+static struct io_uring_cqe *cqes;
+static unsigned *cq_head, *cq_tail, cq_mask;
+static struct io_uring_buf_ring *buf_ring;
+static char *bufs;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+		       unsigned flags, void *arg, size_t arg_size)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		      flags, arg, arg_size);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+static void uring_buf_add(unsigned bid)
+{
+	unsigned short tail = buf_ring->tail;
+	struct io_uring_buf *b = &buf_ring->bufs[tail & (URING_BUF_CNT - 1)];
+
+	b->addr = (uintptr_t)(bufs + bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* This needs Linux 5.19, as do multishot accept and cancelling all
+ * requests of an event_op. */
+static int uring_buf_init(void)
+{
+	struct io_uring_buf_reg reg;
+
+	buf_ring = mmap(NULL, URING_BUF_CNT * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (buf_ring == MAP_FAILED)
+		return -errno;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)buf_ring;
+	reg.ring_entries = URING_BUF_CNT;
+	reg.bgid = URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) < 0) {
+		int ret = -errno;
+
+		munmap(buf_ring, URING_BUF_CNT * sizeof(struct io_uring_buf));
+		return ret;
+	}
+	bufs = salloc(URING_BUF_CNT * URING_BUF_SIZE);
+	for (unsigned i = 0; i < URING_BUF_CNT; i++)
+		uring_buf_add(i);
+	return 0;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *ring;
+	int ret;
+
+	/* Only this thread uses the ring and the completions are reaped by
+	 * io_uring_enter only: the kernel then does not need to interrupt
+	 * the process to run the completion work. */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_fd < 0 && errno == EINVAL) {
+		/* before Linux 6.1 */
+		memset(&p, 0, sizeof(p));
+		ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (ring_fd < 0)
+		return -errno;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		ret = -EOPNOTSUPP;
+		goto error;
+	}
+
+	/* both rings share a single mapping */
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto error_errno;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto error_errno;
+
+	sq_head = (unsigned *)(ring + p.sq_off.head);
+	sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(ring + p.sq_off.array);
+	cq_head = (unsigned *)(ring + p.cq_off.head);
+	cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	ret = uring_buf_init();
+	if (ret < 0)
+		goto error;
+	log_info("using io_uring event backend");
+	return 0;
+
+error_errno:
+	ret = -errno;
+error:
+	close(ring_fd);
+	return ret;
+}
+
+static unsigned uring_pending(void)
+{
+	return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Returns a cleared submission entry. It is submitted with the next wait,
+ * unless the submission ring is full. */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	unsigned tail = *sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (uring_pending() > sq_mask) {
+		int ret = uring_enter(uring_pending(), 0, 0, NULL, 0);
+
+		if (ret < 0) {
+			log_err("cannot submit io_uring requests: %s (%d)",
+				strerror(-ret), -ret);
+			return NULL;
+		}
+	}
+	sqe = &sqes[tail & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[tail & sq_mask] = tail & sq_mask;
+	/* read by the kernel only in io_uring_enter */
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+static int uring_queue(int op, int fd, unsigned events, uint64_t addr,
+		       uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->addr = addr;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+bool event_uring(void)
+{
+	return use_uring;
+}
+
+struct io_uring_sqe *event_op_sqe(struct event_op *op)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (sqe)
+		sqe->user_data = (uintptr_t)op | URING_OP;
+	return sqe;
+}
+
+int event_op_cancel(struct event_op *op)
+{
+	/* user data 0 is never a valid key, the result is ignored */
+	int ret = uring_queue(IORING_OP_ASYNC_CANCEL, -1, 0,
+			      (uintptr_t)op | URING_OP, 0);
+
+	if (ret < 0)
+		return ret;
+	sqes[(*sq_tail - 1) & sq_mask].cancel_flags = IORING_ASYNC_CANCEL_ALL;
+	return 0;
+}
+
+int event_reserve(unsigned cnt)
+{
+	int ret = 0;
+
+	if (uring_pending() + cnt > sq_mask + 1)
+		ret = uring_enter(uring_pending(), 0, 0, NULL, 0);
+	return ret < 0 ? ret : 0;
+}
+
+int event_submit(void)
+{
+	int ret = uring_enter(uring_pending(), 0, 0, NULL, 0);
+
+	return ret < 0 ? ret : 0;
+}
+
+void event_buf_select(struct io_uring_sqe *sqe)
+{
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+}
+
+void *event_buf_get(unsigned flags)
+{
+	return bufs + (flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE;
+}
+
+void event_buf_put(unsigned flags)
+{
+	uring_buf_add(flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+static int uring_del_fd_data(struct fd_data *fdd)
+{
+	int ret;
+
+	/* user data 0 is never a valid key, the result is ignored */
+	ret = uring_queue(IORING_OP_POLL_REMOVE, -1, 0, fdd_key(fdd), 0);
+	if (ret < 0)
+		return ret;
+	fdd->registered = false;
+	return 0;
+}
+
+static int uring_sync_fd_data(struct fd_data *fdd, unsigned events)
+{
+	int ret;
+
+	if (fdd->registered && (!fdd->enabled || events != fdd->kernel_events)) {
+		ret = uring_del_fd_data(fdd);
+		if (ret < 0)
+			return ret;
+	}
+	/* the sockets doing their I/O by event_op have no interest */
+	if (!fdd->enabled || !events || fdd->registered)
+		return 0;
+
+	fdd->gen = ++fdd_gen;
+	ret = uring_queue(IORING_OP_POLL_ADD, fdd->fd, events, 0, fdd_key(fdd));
+	if (ret < 0)
+		return ret;
+	fdd->registered = true;
+	fdd->kernel_events = events;
+	return 0;
+}
+
+static int uring_dispatch(void)
+{
+	unsigned head = *cq_head;
+
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+		uint64_t key = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		struct fd_data *fdd;
+		int ret;
+
+		__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+		if (key & URING_OP) {
+			struct event_op *op = (void *)(uintptr_t)(key - URING_OP);
+
+			op->cb(op, res, flags);
+			continue;
+		}
+		fdd = find_event_key(key);
+		if (!fdd)
+			continue;
+		/* the request is consumed */
+		fdd->registered = false;
+		if (res < 0) {
+			log_warn("cannot poll fd %d: %s (%d)", fdd->fd,
+				 strerror(-res), -res);
+			continue;
+		}
+		ret = fdd->cb(fdd->fd, res, fdd->cb_data);
+		if (ret < 0)
+			return ret;
+		/* re-arm, unless the fd was deleted by the callback */
+		if (find_event_key(key))
+			event_change_fd_data(fdd);
+	}
+	return 0;
+}
+
+static int uring_run(void)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	uint64_t next, now;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	time_flush_cache();
+	next = wheel_next();
+	if (next != WHEEL_NEVER) {
+		now = wheel_now();
+		next = next > now ? next - now : 0;
+		ts.tv_sec = next / 1000;
+		ts.tv_nsec = next % 1000 * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+	ret = uring_enter(uring_pending(), 1,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			  &arg, sizeof(arg));
+	if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY)
+		return ret;
+	time_flush_cache();
+	ret = uring_dispatch();
+	if (ret < 0)
+		return ret;
+	return timers_run();
 }
@@ -15,25 +15,71 @@ typedef int (*event_callback_t)(int fd, unsigned events, void *data);
 
 typedef void (*cb_data_destructor_t)(void *data);
 
-int event_init(void);
+/* If "uring" is true, io_uring is used instead of epoll (falling back to
+ * epoll if not supported by the kernel). The callback semantics are the
+ * same for both. */
+int event_init(bool uring);
 int event_add_fd(int fd, unsigned events, event_callback_t cb, void *cb_data,
 		 cb_data_destructor_t cb_destructor);
 int event_del_fd(int fd);
+
+/* The functions below only record the new interest. It is applied to the
+ * kernel once per loop iteration, right before waiting for new events, and
+ * only when it differs from the registered one. */
 int event_enable_fd(int fd, bool enable);
 int event_pause_fd(int fd, bool pause);
 int event_change_fd(int fd, unsigned events);
 int event_change_fd_add(int fd, unsigned events);
 int event_change_fd_remove(int fd, unsigned events);
 void event_ignore_pid(pid_t pid);
+
+/* Calls "cb" once, after the events that are ready now are processed and
+ * before waiting for new ones. */
+typedef void (*event_defer_cb_t)(void *data);
+int event_defer(event_defer_cb_t cb, void *data);
+
+/* Completion based I/O, available with the io_uring backend only (see
+ * event_uring). The completion of a request queued by event_op_sqe is
+ * passed to "op->cb" with the result and the flags of the completion. */
+struct io_uring_sqe;
+struct event_op;
+typedef void (*event_op_cb_t)(struct event_op *op, int res, unsigned flags);
+
+struct event_op {
+	event_op_cb_t cb;
+};
+
+bool event_uring(void);
+/* Returns a cleared submission entry for "op" or NULL on error. It is
+ * submitted with the next wait or by event_submit. */
+struct io_uring_sqe *event_op_sqe(struct event_op *op);
+/* All requests of "op" in flight complete with -ECANCELED, unless they
+ * have completed already. */
+int event_op_cancel(struct event_op *op);
+/* Makes sure the next "cnt" entries are submitted together, e.g. a chain
+ * of linked requests. */
+int event_reserve(unsigned cnt);
+int event_submit(void);
+/* Lets the receive request pick a buffer from the shared pool. The
+ * completion flags identify the buffer, which is to be returned by
+ * event_buf_put once its data are consumed. */
+void event_buf_select(struct io_uring_sqe *sqe);
+void *event_buf_get(unsigned flags);
+void event_buf_put(unsigned flags);
+
 int event_loop(void);
 void event_quit(void);
 
 /* Timers */
 
+/* All timers are multiplexed to a single timerfd, timer identifiers are thus
+ * not file descriptors. Arming, disarming, pausing and resuming a timer does
+ * not involve any system call. */
+
 /* For return values, see event_callback_t. The "count" parameter contains
  * a value indicating how many times the alarm was fired since the last
  * call. This may be greater than one e.g. in case it was paused. */
-typedef int (*timer_callback_t)(int fd, int count, void *data);
+typedef int (*timer_callback_t)(int id, int count, void *data);
 
 /* Adds a new timer. "cb" is the callback that is called whenever the timer
  * fires, "cb_data" is user data passed to the callback, "cb_destructor" is
@@ -46,22 +92,22 @@ int timer_new(timer_callback_t cb, void *cb_data,
  * miliseconds. If "repeat" is false, it will be a one shot (but it's of
  * course possible to call "timer_arm" again), if it's true, the timer will
  * fire repeatedly every "milisecs". */
-int timer_arm(int fd, int milisecs, bool repeat);
+int timer_arm(int id, int milisecs, bool repeat);
 
 /* Disarms the given timer. It's guaranteed that the callback won't be
  * called after this call. */
-int timer_disarm(int fd);
+int timer_disarm(int id);
 
 /* Pauses the given timer. If the callback has been already scheduled, it
  * will be fired right after resume. */
-int timer_pause(int fd);
+int timer_pause(int id);
 
 /* Resumes the given timer. Be aware that the callback may be called from
  * within this function! */
-int timer_resume(int fd);
+int timer_resume(int id);
 
 /* Deletes the given timer. If it's armed, it will be automatically
  * disarmed. */
-int timer_del(int fd);
+int timer_del(int id);
 
 #endif
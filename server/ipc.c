@@ -1,20 +1,34 @@
 #include "ipc.h"
 #include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "common.h"
+#include "config.h"
 #include "db.h"
 #include "event.h"
 #include "level.h"
 #include "log.h"
 #include "proto.h"
+#include "proto_msg.h"
 #include "socket.h"
+#include "time.h"
 #include "websocket_data.h"
 
 #define IDLE_TIMEOUT	500
 static int idle_timer;
 
+/* In a message to a child, each fd is described by this header, followed
+ * by "len" bytes of data read from the socket by the master. */
+struct fd_info {
+	int type;
+	int len;
+};
+
+#define FDS_BUF_SIZE	(IPC_FDS_MAX * (sizeof(struct fd_info) + IPC_DATA_MAX))
+
 static void cancel_idle_timer(void)
 {
 	if (idle_timer < 0)
@@ -23,55 +37,84 @@ static void cancel_idle_timer(void)
 	idle_timer = -1;
 }
 
-#define BUF_SIZE	512
-static void pipe_read(struct socket *s, void *data __unused)
+/* Receives a message with fds attached to the socket's input buffer.
+ * Stores up to IPC_FDS_MAX fds to "fds" and returns their number. The
+ * message has to be consumed by the caller. */
+static int recv_fds(struct socket *s, int *fds)
 {
-	char buf[BUF_SIZE];
 	union {
-		char ancil[BUF_SIZE];
+		char ancil[CMSG_SPACE(sizeof(int) * IPC_FDS_MAX)];
 		struct cmsghdr cmsg;
 	} u;
-	size_t buf_len;
-	size_t ancil_len = BUF_SIZE;
+	size_t ancil_len = sizeof(u.ancil);
+	int cnt;
 
-	buf_len = socket_read_ancil(s, buf, BUF_SIZE, u.ancil, &ancil_len);
-	if (ancil_len) {
-		int fd;
-		int type;
+	socket_fill_ancil(s, u.ancil, &ancil_len);
+	if (!ancil_len)
+		return 0;
+	if (u.cmsg.cmsg_level != SOL_SOCKET || u.cmsg.cmsg_type != SCM_RIGHTS) {
+		log_info("received unknown ancillary message");
+		return 0;
+	}
+	cnt = (u.cmsg.cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(&u.cmsg), cnt * sizeof(int));
+	return cnt;
+}
 
-		if (u.cmsg.cmsg_level != SOL_SOCKET || u.cmsg.cmsg_type != SCM_RIGHTS) {
-			log_info("received unknown ancillary message");
-			return;
-		}
-		if (u.cmsg.cmsg_len != CMSG_LEN(sizeof(int))) {
-			log_info("received ancillary message with unexpected length");
-			return;
-		}
-		memcpy(&fd, CMSG_DATA(&u.cmsg), sizeof(int));
-		if (buf_len != sizeof(int)) {
-			log_info("received fd %d with no type", fd);
+static void close_fds(int *fds, int cnt)
+{
+	for (int i = 0; i < cnt; i++)
+		close(fds[i]);
+}
+
+static void add_fd(int fd, int type, char *data, size_t len)
+{
+	if (type == IPC_FD_WEBSOCKET) {
+		log_info("received websocket fd %d", fd);
+		if (websocket_add(fd) < 0) {
 			close(fd);
 			return;
 		}
-		memcpy(&type, buf, sizeof(int));
-		if (type == IPC_FD_WEBSOCKET) {
-			log_info("received websocket fd %d", fd);
-			if (websocket_add(fd) < 0) {
-				close(fd);
-				return;
-			}
-			level_dirty();
-		} else if (type == IPC_FD_APP_CRLF || type == IPC_FD_APP_LF) {
-			log_info("received app socket fd %d (type %d)", fd, type);
-			if (proto_client_add(fd, type == IPC_FD_APP_CRLF) < 0)
-				return;
-		} else {
-			log_info("received fd %d of unknown type %d", fd, type);
-			close(fd);
+		level_dirty();
+	} else if (type == IPC_FD_APP_CRLF || type == IPC_FD_APP_LF) {
+		log_info("received app socket fd %d (type %d)", fd, type);
+		if (proto_client_add(fd, type == IPC_FD_APP_CRLF, data, len) < 0)
 			return;
-		}
-		cancel_idle_timer();
+	} else {
+		log_info("received fd %d of unknown type %d", fd, type);
+		close(fd);
+		return;
 	}
+	cancel_idle_timer();
+}
+
+static void pipe_read(struct socket *s, void *data __unused)
+{
+	int fds[IPC_FDS_MAX];
+	size_t len, pos = 0;
+	char *buf;
+	int cnt, i;
+
+	cnt = recv_fds(s, fds);
+	buf = socket_input(s, &len);
+	for (i = 0; i < cnt; i++) {
+		struct fd_info info;
+
+		if (len - pos < sizeof(info))
+			break;
+		memcpy(&info, buf + pos, sizeof(info));
+		pos += sizeof(info);
+		if (info.len < 0 || info.len > IPC_DATA_MAX ||
+		    len - pos < (size_t)info.len)
+			break;
+		add_fd(fds[i], info.type, buf + pos, info.len);
+		pos += info.len;
+	}
+	if (i < cnt) {
+		log_info("received %d fds with a malformed message", cnt);
+		close_fds(fds + i, cnt - i);
+	}
+	socket_consume(s, len);
 }
 
 static int idle_expired(int fd __unused, int count __unused, void *data __unused)
@@ -90,6 +133,7 @@ int ipc_client_init(void)
 		return -ENOTSOCK;
 	/* We never close fd 2. */
 	socket_set_unmanaged(s);
+	socket_set_input_max(s, FDS_BUF_SIZE);
 
 	idle_timer = timer_new(idle_expired, NULL, NULL);
 	if (idle_timer < 0)
@@ -99,19 +143,29 @@ int ipc_client_init(void)
 	return 0;
 }
 
-static int ipc_send_fd(struct socket *s, int fd, int type)
+void ipc_report_idle(bool idle)
+{
+	struct ipc_child_msg msg = { .zero = 0, .idle = idle };
+
+	/* fd 2 is a SOCK_SEQPACKET socket, the message is never merged
+	 * with the log output */
+	if (write(2, &msg, sizeof(msg)) < 0)
+		log_warn("cannot report the idle state to the master: %s", strerror(errno));
+}
+
+int ipc_send_fds(struct socket *s, int *fds, int cnt, void *buf, size_t size)
 {
 	struct cmsghdr *cmsg;
 	size_t len;
 	int ret;
 
-	len = CMSG_LEN(sizeof(int));
+	len = CMSG_LEN(cnt * sizeof(int));
 	cmsg = salloc(len);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
 	cmsg->cmsg_len = len;
-	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
-	ret = socket_write_ancil(s, &type, sizeof(int), false, cmsg, len, true, fd);
+	memcpy(CMSG_DATA(cmsg), fds, cnt * sizeof(int));
+	ret = socket_write_ancil(s, buf, size, false, cmsg, len, true, true);
 	if (ret < 0) {
 		sfree(cmsg);
 		return ret;
@@ -119,6 +173,11 @@ static int ipc_send_fd(struct socket *s, int fd, int type)
 	return 0;
 }
 
+int ipc_send_fd(struct socket *s, int fd, void *buf, size_t size)
+{
+	return ipc_send_fds(s, &fd, 1, buf, size);
+}
+
 static const char *str_type(int type)
 {
 	if (type == IPC_FD_WEBSOCKET)
@@ -126,18 +185,373 @@ static const char *str_type(int type)
 	return "app socket";
 }
 
-void ipc_send_socket(char *login, struct socket *what, int type)
+/*** Handoff batching ***/
+
+/* The fds for a child are collected until the end of the loop iteration
+ * and then sent in a single message, with a struct fd_info and data for
+ * each fd. */
+
+#define BATCHES_MAX	32
+
+struct batch {
+	struct socket *pipe;
+	int cnt;
+	int fds[IPC_FDS_MAX];
+	/* FDS_BUF_SIZE, allocated on the first use of the slot */
+	char *buf;
+	size_t size;
+};
+
+static struct batch batches[BATCHES_MAX];
+static int batches_cnt;
+static bool batches_scheduled;
+
+static void batch_send(struct batch *b)
+{
+	if (ipc_send_fds(b->pipe, b->fds, b->cnt, b->buf, b->size) < 0) {
+		log_warn("unable to send %d fds to a child", b->cnt);
+		close_fds(b->fds, b->cnt);
+	}
+	b->cnt = 0;
+	b->size = 0;
+}
+
+/* Appends the fd description to the buffer, returns the new size. */
+static size_t put_fd_info(char *buf, size_t size, int type, const void *data,
+			  size_t len)
+{
+	struct fd_info info = { .type = type, .len = len };
+
+	memcpy(buf + size, &info, sizeof(info));
+	memcpy(buf + size + sizeof(info), data, len);
+	return size + sizeof(info) + len;
+}
+
+static void batches_flush(void *data __unused)
+{
+	for (int i = 0; i < batches_cnt; i++) {
+		batch_send(&batches[i]);
+		socket_unref(batches[i].pipe);
+	}
+	batches_cnt = 0;
+	batches_scheduled = false;
+}
+
+static struct batch *batch_get(struct socket *pipe)
+{
+	struct batch *b;
+
+	for (int i = 0; i < batches_cnt; i++)
+		if (batches[i].pipe == pipe)
+			return &batches[i];
+	if (batches_cnt == BATCHES_MAX)
+		batches_flush(NULL);
+	if (!batches_scheduled) {
+		if (event_defer(batches_flush, NULL) < 0)
+			return NULL;
+		batches_scheduled = true;
+	}
+	b = &batches[batches_cnt++];
+	b->pipe = pipe;
+	b->cnt = 0;
+	b->size = 0;
+	if (!b->buf)
+		b->buf = salloc(FDS_BUF_SIZE);
+	socket_ref(pipe);
+	return b;
+}
+
+/* Passes the fd to the child of the given user. The fd is closed once it
+ * is sent. */
+static int send_to_child(const char *login, int fd, int type, const void *data,
+			 size_t len)
 {
 	struct socket *pipe;
-	int fd;
+	struct batch *b;
 
-	socket_del(what);
 	pipe = db_get_pipe(login);
-	fd = socket_get_fd(what);
-	if (!pipe || ipc_send_fd(pipe, fd, type) < 0) {
+	if (!pipe) {
 		log_warn("unable to send %s fd %d to child [%s]", str_type(type), fd, login);
+		return -EPIPE;
+	}
+	log_info("sending %s fd %d to child [%s]", str_type(type), fd, login);
+	b = batch_get(pipe);
+	if (!b) {
+		char buf[sizeof(struct fd_info) + IPC_DATA_MAX];
+		size_t size = put_fd_info(buf, 0, type, data, len);
+
+		if (ipc_send_fd(pipe, fd, buf, size) < 0) {
+			log_warn("unable to send %s fd %d to child [%s]", str_type(type),
+				 fd, login);
+			return -EPIPE;
+		}
+		return 0;
+	}
+	if (b->cnt == IPC_FDS_MAX)
+		batch_send(b);
+	b->fds[b->cnt++] = fd;
+	b->size = put_fd_info(b->buf, b->size, type, data, len);
+	return 0;
+}
+
+/*** Admission queue ***/
+
+/* The fds for logins that cannot get a child now (see db_admit) wait here
+ * until a child exits, at most ADMIT_TIMEOUT ms. */
+
+#define ADMIT_TIMEOUT	10000
+
+struct waiting {
+	char login[LOGIN_LEN + 1];
+	int fd;
+	int type;
+	struct timespec since;
+	struct waiting *next;
+	size_t len;
+	char data[];
+};
+
+static struct waiting *waiting;
+static struct waiting **waiting_tail = &waiting;
+static int waiting_cnt;
+static int waiting_max;
+static int admit_timer = -1;
+static unsigned long admitted_cnt, expired_cnt;
+static long wait_total, wait_longest;
+
+static int ipc_admit_waiting_timer(int fd, int count, void *data);
+
+static void waiting_arm_timer(void)
+{
+	if (!waiting)
+		return;
+	if (admit_timer < 0) {
+		admit_timer = timer_new(ipc_admit_waiting_timer, NULL, NULL);
+		check(admit_timer);
+	}
+	timer_arm(admit_timer, ADMIT_TIMEOUT - time_elapsed(&waiting->since) + 1,
+		  false);
+}
+
+static void waiting_add(const char *login, int fd, int type, const void *data,
+			size_t len)
+{
+	struct waiting *w;
+
+	w = salloc(sizeof(*w) + len);
+	strlcpy(w->login, login, sizeof(w->login));
+	w->fd = fd;
+	w->type = type;
+	w->len = len;
+	memcpy(w->data, data, len);
+	w->since = *time_now();
+	w->next = NULL;
+	*waiting_tail = w;
+	waiting_tail = &w->next;
+	if (++waiting_cnt > waiting_max)
+		waiting_max = waiting_cnt;
+	log_info("%s fd %d for [%s] waiting for admission, %d waiting",
+		 str_type(type), fd, login, waiting_cnt);
+	if (waiting_cnt == 1)
+		waiting_arm_timer();
+	db_make_room(waiting_cnt);
+}
+
+static struct waiting *waiting_pop(void)
+{
+	struct waiting *w = waiting;
+	long waited;
+
+	waiting = w->next;
+	if (!waiting)
+		waiting_tail = &waiting;
+	waiting_cnt--;
+	waited = time_elapsed(&w->since);
+	wait_total += waited;
+	if (waited > wait_longest)
+		wait_longest = waited;
+	return w;
+}
+
+static void waiting_expire(struct waiting *w)
+{
+	char msg[sizeof(P_MSG_BUSY) + 7];
+	size_t len;
+
+	log_info("%s fd %d for [%s] not admitted in %d ms", str_type(w->type),
+		 w->fd, w->login, ADMIT_TIMEOUT);
+	if (w->type != IPC_FD_WEBSOCKET) {
+		/* the client waits for the USER reply */
+		len = snprintf(msg, sizeof(msg), "OVER %s%s", P_MSG_BUSY,
+			       w->type == IPC_FD_APP_CRLF ? "\r\n" : "\n");
+		send(w->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	close(w->fd);
+	expired_cnt++;
+}
+
+void ipc_admit_waiting(void)
+{
+	struct waiting *w;
+
+	while (waiting && db_admit(waiting->login)) {
+		w = waiting_pop();
+		if (send_to_child(w->login, w->fd, w->type, w->data, w->len) < 0)
+			close(w->fd);
+		admitted_cnt++;
+		sfree(w);
+	}
+	while (waiting && time_elapsed(&waiting->since) >= ADMIT_TIMEOUT) {
+		w = waiting_pop();
+		waiting_expire(w);
+		sfree(w);
+	}
+	waiting_arm_timer();
+}
+
+static int ipc_admit_waiting_timer(int fd __unused, int count __unused,
+				   void *data __unused)
+{
+	ipc_admit_waiting();
+	return 0;
+}
+
+int ipc_waiting_count(void)
+{
+	return waiting_cnt;
+}
+
+void ipc_log_stats(void)
+{
+	unsigned long done = admitted_cnt + expired_cnt;
+
+	if (!done && !waiting_max)
+		return;
+	log_info("admission: %d waiting (max %d), %lu admitted, %lu expired, wait avg %ld ms, max %ld ms",
+		 waiting_cnt, waiting_max, admitted_cnt, expired_cnt,
+		 done ? wait_total / (long)done : 0, wait_longest);
+}
+
+/* Passes the fd to the child of the given user, or queues it if the child
+ * cannot be started now. */
+static int route_fd(const char *login, int fd, int type, const void *data,
+		    size_t len)
+{
+	/* keep the order of the new logins */
+	if (!db_admit(login) || (waiting && !db_has_child(login))) {
+		waiting_add(login, fd, type, data, len);
+		return 0;
+	}
+	return send_to_child(login, fd, type, data, len);
+}
+
+/*** Master workers ***/
+
+struct worker_msg {
+	int type;
+	char login[LOGIN_LEN + 1];
+	int len;
+	/* only "len" bytes are sent */
+	char data[IPC_DATA_MAX];
+};
+
+#define WORKER_MSG_LEN(len)	(offsetof(struct worker_msg, data) + (len))
+
+/* in a worker, the socket to the master */
+static struct socket *master;
+
+static void worker_read(struct socket *s, void *data __unused)
+{
+	struct worker_msg msg;
+	int fds[IPC_FDS_MAX];
+	int cnt, fd;
+	size_t len;
+	void *buf;
+
+	cnt = recv_fds(s, fds);
+	buf = socket_input(s, &len);
+	memcpy(&msg, buf, len < sizeof(msg) ? len : sizeof(msg));
+	socket_consume(s, len);
+	if (!cnt)
+		return;
+	if (cnt > 1) {
+		log_info("received %d fds from worker, expected one", cnt);
+		close_fds(fds, cnt);
+		return;
+	}
+	fd = fds[0];
+	if (len < WORKER_MSG_LEN(0) || len > sizeof(msg) || msg.len < 0 ||
+	    len != WORKER_MSG_LEN(msg.len)) {
+		log_info("received fd %d from worker with a malformed message", fd);
+		close(fd);
+		return;
+	}
+	msg.login[LOGIN_LEN] = '\0';
+	if (route_fd(msg.login, fd, msg.type, msg.data, msg.len) < 0)
+		close(fd);
+}
+
+int ipc_worker_add(int fd)
+{
+	if (!socket_add(fd, worker_read, NULL, NULL))
+		return -ENOTSOCK;
+	return 0;
+}
+
+#define BUF_SIZE	512
+static void master_read(struct socket *s, void *data __unused)
+{
+	char buf[BUF_SIZE];
+
+	/* The master never sends anything. A zero read does not mean it
+	 * has gone away, the hangup is detected by the socket layer, see
+	 * master_gone. */
+	while (socket_read(s, buf, BUF_SIZE))
+		;
+}
+
+static void master_gone(void *data __unused)
+{
+	log_info("master has gone away, terminating");
+	event_quit();
+}
+
+int ipc_worker_init(void)
+{
+	master = socket_add(IPC_WORKER_FD, master_read, NULL, master_gone);
+	if (!master)
+		return -ENOTSOCK;
+	socket_set_unmanaged(master);
+	return 0;
+}
+
+int ipc_send_socket(char *login, struct socket *what, int type,
+		    const void *data, size_t len)
+{
+	int fd;
+	int ret;
+
+	fd = socket_get_fd(what);
+	if (len > IPC_DATA_MAX) {
+		log_warn("too much data read from %s fd %d", str_type(type), fd);
+		return -EMSGSIZE;
+	}
+	socket_del(what);
+	if (master) {
+		struct worker_msg msg;
+
+		memset(&msg, 0, WORKER_MSG_LEN(0));
+		msg.type = type;
+		strlcpy(msg.login, login, sizeof(msg.login));
+		msg.len = len;
+		memcpy(msg.data, data, len);
+		ret = ipc_send_fd(master, fd, &msg, WORKER_MSG_LEN(len));
+		if (ret < 0)
+			log_warn("unable to pass %s fd %d to the master", str_type(type), fd);
 	} else {
-		socket_set_unmanaged(what);
-		log_info("sending %s fd %d to child [%s]", str_type(type), fd, login);
+		ret = route_fd(login, fd, type, data, len);
 	}
+	if (ret >= 0)
+		socket_set_unmanaged(what);
+	return 0;
 }
@@ -1,5 +1,6 @@
 #ifndef IPC_H
 #define IPC_H
+#include <stdbool.h>
 #include "socket.h"
 
 enum {
@@ -8,7 +9,53 @@ enum {
 	IPC_FD_APP_CRLF,
 };
 
+/* A message from a child to the master. The channel is also the child's
+ * stderr, the leading zero byte tells the message apart from the log
+ * output. */
+struct ipc_child_msg {
+	char zero;
+	char idle;
+};
+
+/* maximum number of fds in a single message */
+#define IPC_FDS_MAX	16
+
+/* maximum number of bytes already read from a socket that can be passed
+ * along with it */
+#define IPC_DATA_MAX	1024
+
+/* fd of the channel between a master worker and the master */
+#define IPC_WORKER_FD	3
+
 int ipc_client_init(void);
-void ipc_send_socket(char *login, struct socket *what, int type);
+
+/* In a child, tells the master whether it has no bound app socket. */
+void ipc_report_idle(bool idle);
+
+/* In the master, adds the channel to a worker. */
+int ipc_worker_add(int fd);
+
+/* In a worker, sets up the channel to the master. Sockets passed by
+ * ipc_send_socket are then routed to the children by the master. */
+int ipc_worker_init(void);
+
+/* Passes the socket to the child of the given user. "data" are the bytes
+ * already read from the socket but not consumed; the child processes them
+ * before reading the socket. With more than IPC_DATA_MAX bytes, returns
+ * -EMSGSIZE and leaves the socket to the caller. */
+int ipc_send_socket(char *login, struct socket *what, int type,
+		    const void *data, size_t len);
+
+/* In the master, passes the waiting fds to the children that may be
+ * started now and drops the fds waiting for too long. */
+void ipc_admit_waiting(void);
+int ipc_waiting_count(void);
+void ipc_log_stats(void);
+
+/* Queues "buf" with "fd" attached to be sent to "s". The fd is closed once
+ * it is sent. */
+int ipc_send_fd(struct socket *s, int fd, void *buf, size_t size);
+/* The same for "cnt" fds, at most IPC_FDS_MAX. */
+int ipc_send_fds(struct socket *s, int *fds, int cnt, void *buf, size_t size);
 
 #endif
@@ -19,6 +19,22 @@ struct level_ops {
 	 * After this time, all connections are terminated. */
 	int max_time;
 
+	/* Rate limits of the data sent to the clients: 'rate' in bytes per
+	 * second and 'bucket' (the maximum burst) in bytes apply to each
+	 * connection, 'user_rate' and 'user_bucket' to all connections of
+	 * the user together. Zero means the default (12000 B/s with 60000
+	 * B bucket per connection, three times that per user), negative
+	 * means no limit. */
+	int rate;
+	int bucket;
+	int user_rate;
+	int user_bucket;
+
+	/* The maximum number of commands a client may send without waiting
+	 * for the responses, if it asks for pipelining at LEVL. Zero means
+	 * the default (16), negative disables pipelining. */
+	int pipeline;
+
 	/* Callback called right after the level is loaded. */
 	void (*init)(void);
 
@@ -49,6 +65,12 @@ struct level_ops {
 	 * the function should return its own statically allocated buffer. */
 	char *(*maze)(void *data, unsigned char **res, unsigned *len);
 
+	/* Stores the colors of the 'w' x 'h' rectangle with the top left
+	 * corner at 'x', 'y' to 'res', row by row. 'w' and 'h' are
+	 * positive, 'res' has room for 'w' * 'h' colors. This function can
+	 * be NULL, 'what' is then called for each position. */
+	char *(*area)(void *data, int x, int y, int w, int h, unsigned char *res);
+
 	/* Stores the actual x position to '*res'. */
 	char *(*get_x)(void *data, int *res);
 
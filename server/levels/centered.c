@@ -52,6 +52,17 @@ char *centered_maze(void *data, unsigned char **res, unsigned *len)
 	return NULL;
 }
 
+char *centered_area(void *data, int x, int y, int w, int h, unsigned char *res)
+{
+	if (x < 0 || x > DRAW_MOD_WIDTH - w || y < 0 || y > DRAW_MOD_HEIGHT - h)
+		return A_MSG_OUT_OF_MAZE;
+
+	for (int i = 0; i < h; i++)
+		for (int j = 0; j < w; j++)
+			*res++ = get_color(data, x + j, y + i, true);
+	return NULL;
+}
+
 char *centered_get_x(void *data __unused, int *res)
 {
 	*res = DRAW_MOD_WIDTH / 2;
@@ -22,10 +22,11 @@ void centered_init(int width, int height, const unsigned char *level,
 #define centered_get_data	grid_get_data
 #define centered_free_data	grid_free_data
 
-/* These should be set as the level's 'what', 'maze', 'get_x', 'get_y',
- * 'get_w' and 'get_h' callbacks, respectively. */
+/* These should be set as the level's 'what', 'maze', 'area', 'get_x',
+ * 'get_y', 'get_w' and 'get_h' callbacks, respectively. */
 char *centered_what(void *data, int x, int y, int *res);
 char *centered_maze(void *data, unsigned char **res, unsigned *len);
+char *centered_area(void *data, int x, int y, int w, int h, unsigned char *res);
 char *centered_get_x(void *data, int *res);
 char *centered_get_y(void *data, int *res);
 char *centered_get_w(void *data, int *res);
@@ -63,6 +64,7 @@ void centered_move_commit(void *data);
 		.move = move_,						\
 		.what = centered_what,					\
 		.maze = centered_maze,					\
+		.area = centered_area,					\
 		.get_x = centered_get_x,				\
 		.get_y = centered_get_y,				\
 		.get_w = centered_get_w,				\
@@ -78,6 +78,23 @@ char *simple_maze(void *data __unused, unsigned char **res, unsigned *len)
 	return NULL;
 }
 
+char *simple_area(void *data __unused, int x, int y, int w, int h,
+		  unsigned char *res)
+{
+	struct simple_data *d;
+
+	if (x < 0 || x > width - w || y < 0 || y > height - h)
+		return A_MSG_OUT_OF_MAZE;
+
+	for (int i = 0; i < h; i++)
+		memcpy(res + i * w, level_data + (y + i) * width + x, w);
+	for_each_player(d) {
+		if (d->x >= x && d->x < x + w && d->y >= y && d->y < y + h)
+			res[(d->y - y) * w + d->x - x] = COLOR_PLAYER;
+	}
+	return NULL;
+}
+
 char *simple_get_x(void *data, int *res)
 {
 	struct simple_data *d = data;
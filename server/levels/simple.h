@@ -23,10 +23,11 @@ void simple_init(int width, int height, const unsigned char *level,
 void *simple_get_data(void);
 void simple_free_data(void *data);
 
-/* These should be set as the level's 'what', 'maze', 'get_x', 'get_y',
- * 'get_w' and 'get_h' callbacks, respectively. */
+/* These should be set as the level's 'what', 'maze', 'area', 'get_x',
+ * 'get_y', 'get_w' and 'get_h' callbacks, respectively. */
 char *simple_what(void *data, int x, int y, int *res);
 char *simple_maze(void *data, unsigned char **res, unsigned *len);
+char *simple_area(void *data, int x, int y, int w, int h, unsigned char *res);
 char *simple_get_x(void *data, int *res);
 char *simple_get_y(void *data, int *res);
 char *simple_get_w(void *data, int *res);
@@ -67,6 +68,7 @@ void simple_ensure_visible(int x, int y);
 		.move = move_,						\
 		.what = simple_what,					\
 		.maze = simple_maze,					\
+		.area = simple_area,					\
 		.get_x = simple_get_x,					\
 		.get_y = simple_get_y,					\
 		.get_w = simple_get_w,					\
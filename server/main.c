@@ -1,6 +1,8 @@
 #include <getopt.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "app.h"
@@ -19,15 +21,14 @@
 
 #define WEBSOCKET_PORT	1234
 #define APP_PORT	4000
+#define WORKERS_MAX	64
+#define POOL_MAX	1024
+#define LINGER_MAX	3600000
 
-static void init_master(char *argv0, bool use_syslog)
+static void listen_ports(void)
 {
 	int port, res;
 
-	log_init("<mazec>", use_syslog);
-	check(event_init());
-	spawn_init(argv0, use_syslog);
-	check(db_init());
 	port = APP_PORT;
 	res = proto_server_init(port);
 	if (!res) {
@@ -40,12 +41,78 @@ static void init_master(char *argv0, bool use_syslog)
 	}
 }
 
-static void init_child(char *login, bool use_syslog)
+/* Unix sockets are served by the master even with workers: a socket path
+ * cannot be shared like a port. */
+static void listen_unix(const char *app_path, const char *ws_path)
+{
+	const char *path = app_path;
+	int res = 0;
+
+	if (app_path)
+		res = proto_server_init_unix(app_path);
+	if (!res && ws_path) {
+		path = ws_path;
+		res = websocket_http_init_unix(ws_path);
+	}
+	if (res < 0) {
+		log_err("cannot listen on %s: %s (%d)", path, strerror(-res), -res);
+		exit(1);
+	}
+}
+
+static void init_master(char *argv0, bool use_syslog, bool use_uring,
+			int workers, bool zygote, int pool, int linger,
+			int max_children, unsigned long max_mem,
+			const char *app_path, const char *ws_path)
 {
+	log_init("<mazec>", use_syslog);
+	check(event_init(use_uring));
+	spawn_init(argv0, use_syslog, use_uring, linger);
+	check(db_init());
+	check(db_set_limits(max_children, max_mem));
+	if (zygote)
+		check(spawn_zygote());
+	if (pool)
+		check(spawn_pool(pool));
+	if (workers)
+		check(spawn_workers(workers));
+	else
+		listen_ports();
+	listen_unix(app_path, ws_path);
+}
+
+static void init_worker(bool use_syslog, bool use_uring)
+{
+	log_init("<worker>", use_syslog);
+	check(event_init(use_uring));
+	check(db_init());
+	check(ipc_worker_init());
+	socket_set_reuse_port(true);
+	listen_ports();
+}
+
+/* Returns in the forked children only. */
+static char *run_zygote(bool use_syslog)
+{
+	log_init("<zygote>", use_syslog);
+	pyb_preload();
+	log_info("started");
+	return spawn_zygote_run();
+}
+
+/* An empty login means a pooled child. */
+static void init_child(char *login, bool use_syslog, bool use_uring, int linger)
+{
+	if (!*login) {
+		log_init("<pooled>", use_syslog);
+		/* get warm while waiting */
+		pyb_preload();
+		login = spawn_wait_bind();
+	}
 	log_init(login, use_syslog);
-	check(event_init());
+	check(event_init(use_uring));
 	check(ipc_client_init());
-	proto_client_init(login, event_quit);
+	proto_client_init(login, event_quit, linger);
 	websocket_init(app_remote_command, proto_cond_close);
 	draw_init();
 }
@@ -64,6 +131,19 @@ void help(char *argv0)
 		"\n"
 		"  -i, --interactive    start interactive Python 3 session\n"
 		"  -s, --syslog         log to syslog instead of stderr\n"
+		"  -u, --uring          use io_uring instead of epoll\n"
+		"  -w, --workers=N      accept connections in N worker processes\n"
+		"  -z, --zygote         fork children from a preloaded process\n"
+		"  -p, --pool=N         keep N idle children ready for new logins\n"
+		"  -l, --linger=MS      keep the level loaded for MS ms after the last\n"
+		"                       connection is closed\n"
+		"  -c, --max-children=N start at most N children, new logins wait\n"
+		"  -m, --max-mem=MB     start no children while they use more than MB\n"
+		"                       megabytes in total, terminate idle ones above it\n"
+		"  -a, --app-socket=PATH\n"
+		"                       accept app connections also on the Unix socket\n"
+		"                       PATH, @NAME for the abstract namespace\n"
+		"  -b, --ws-socket=PATH the same for websocket connections\n"
 		"  -h, --help           this help\n",
 		argv0
 	    );
@@ -74,13 +154,30 @@ int main(int argc, char **argv)
 	static const struct option longopts[] = {
 		{ "interactive", no_argument, NULL, 'i' },
 		{ "syslog", no_argument, NULL, 's' },
+		{ "uring", no_argument, NULL, 'u' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "worker", no_argument, NULL, 'W' },
+		{ "zygote", no_argument, NULL, 'z' },
+		{ "zygote-process", no_argument, NULL, 'Z' },
+		{ "pool", required_argument, NULL, 'p' },
+		{ "pooled", no_argument, NULL, 'P' },
+		{ "linger", required_argument, NULL, 'l' },
+		{ "max-children", required_argument, NULL, 'c' },
+		{ "max-mem", required_argument, NULL, 'm' },
+		{ "app-socket", required_argument, NULL, 'a' },
+		{ "ws-socket", required_argument, NULL, 'b' },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 }
 	};
 	int opt;
-	bool opt_interactive = false, opt_syslog = false;
+	bool opt_interactive = false, opt_syslog = false, opt_uring = false;
+	bool opt_worker = false, opt_zygote = false, opt_zygote_process = false;
+	bool opt_pooled = false;
+	int opt_workers = 0, opt_pool = 0, opt_linger = 0, opt_max_children = 0;
+	long opt_max_mem = 0;
+	char *opt_app_socket = NULL, *opt_ws_socket = NULL;
 
-	while ((opt = getopt_long(argc, argv, "ish", longopts, NULL)) >= 0) {
+	while ((opt = getopt_long(argc, argv, "isuw:zp:l:c:m:a:b:h", longopts, NULL)) >= 0) {
 		switch (opt) {
 		case 'i':
 			opt_interactive = true;
@@ -88,6 +185,68 @@ int main(int argc, char **argv)
 		case 's':
 			opt_syslog = true;
 			break;
+		case 'u':
+			opt_uring = true;
+			break;
+		case 'w':
+			opt_workers = atoi(optarg);
+			if (opt_workers < 1 || opt_workers > WORKERS_MAX) {
+				fprintf(stderr, "The number of workers must be between 1 and %d.\n",
+					WORKERS_MAX);
+				return 1;
+			}
+			break;
+		case 'W':
+			/* internal, used by spawn_workers */
+			opt_worker = true;
+			break;
+		case 'z':
+			opt_zygote = true;
+			break;
+		case 'Z':
+			/* internal, used by spawn_zygote */
+			opt_zygote_process = true;
+			break;
+		case 'p':
+			opt_pool = atoi(optarg);
+			if (opt_pool < 1 || opt_pool > POOL_MAX) {
+				fprintf(stderr, "The pool size must be between 1 and %d.\n",
+					POOL_MAX);
+				return 1;
+			}
+			break;
+		case 'P':
+			/* internal, used by spawn_pool */
+			opt_pooled = true;
+			break;
+		case 'l':
+			opt_linger = atoi(optarg);
+			if (opt_linger < 1 || opt_linger > LINGER_MAX) {
+				fprintf(stderr, "The linger period must be between 1 and %d ms.\n",
+					LINGER_MAX);
+				return 1;
+			}
+			break;
+		case 'c':
+			opt_max_children = atoi(optarg);
+			if (opt_max_children < 1) {
+				fprintf(stderr, "The number of children must be positive.\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			opt_max_mem = atol(optarg);
+			if (opt_max_mem < 1) {
+				fprintf(stderr, "The memory budget must be a positive number of MB.\n");
+				return 1;
+			}
+			break;
+		case 'a':
+			opt_app_socket = optarg;
+			break;
+		case 'b':
+			opt_ws_socket = optarg;
+			break;
 		case 'h':
 			help(argv[0]);
 			return 0;
@@ -104,13 +263,24 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	if (optind < argc)
-		init_child(argv[optind], opt_syslog);
+	if (opt_worker)
+		init_worker(opt_syslog, opt_uring);
+	else if (opt_zygote_process)
+		init_child(run_zygote(opt_syslog), opt_syslog, opt_uring,
+			   opt_linger);
+	else if (opt_pooled)
+		init_child("", opt_syslog, opt_uring, opt_linger);
+	else if (optind < argc)
+		init_child(argv[optind], opt_syslog, opt_uring, opt_linger);
 	else
-		init_master(argv[0], opt_syslog);
+		init_master(argv[0], opt_syslog, opt_uring, opt_workers,
+			    opt_zygote, opt_pool, opt_linger, opt_max_children,
+			    (unsigned long)opt_max_mem << 20, opt_app_socket,
+			    opt_ws_socket);
 
 	log_info("started");
 	check(event_loop());
+	spawn_signal_workers(SIGTERM);
 	log_info("terminating cleanly");
 	return 0;
 }
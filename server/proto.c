@@ -22,11 +22,40 @@
 
 #define BUF_SIZE	1024
 #define CMD_LEN		4
-#define VAL_LEN		LOGIN_LEN
+/* long enough for the moves of MOVS */
+#define VAL_LEN		1024
+/* the longest message with the given value length without whitespace
+ * padding, including CRLF */
+#define MSG_LEN(val_len)	(CMD_LEN + 1 + (val_len) + 2)
+
+/* the default limit of pipelined commands, see struct level_ops */
+#define PIPELINE		16
+
+/* the maximum number of positions returned by AREA */
+#define AREA_MAX		65536
+
+/* longer DATA responses are generated as the socket drains */
+#define DATA_STREAM_MIN		(64 * 1024)
 
 #define REDRAW_INTERVAL		200
 #define CAN_PAUSE_INTERVAL	1000
 
+/* Default rate limits in bytes per second and bucket sizes in bytes, see
+ * struct level_ops. */
+#define RATE			12000
+#define BUCKET_SIZE		60000
+#define USER_RATE		36000
+#define USER_BUCKET_SIZE	180000
+/* the limit of all the data sent by the master */
+#define SERVER_RATE		(1024 * 1024)
+#define SERVER_BUCKET_SIZE	(1024 * 1024)
+
+/* The time to send USER, in miliseconds, and the minimum average rate of
+ * the received data in bytes per second. No rate is required, people type
+ * the command by hand. */
+#define HANDSHAKE_TIMEOUT	30000
+#define HANDSHAKE_MIN_RATE	0
+
 struct p_data;
 typedef char *(*cmd_process_t)(struct p_data *pd);
 
@@ -34,19 +63,26 @@ struct p_data {
 	struct socket *s;
 	char cmd[CMD_LEN + 1];
 	char val[VAL_LEN + 1];
-	unsigned int cmd_len;
 	unsigned int val_len;
+	/* the longest value accepted, VAL_LEN or LOGIN_LEN for USER */
+	unsigned int val_max;
 	bool msg_complete;
 	bool is_val;
 	bool crlf;
-	bool expect_lf;
 	cmd_process_t process;
 	void *data;
 	bool bound;
+	/* the socket is being closed, or in the master, handed off */
+	bool closing;
+	/* the number of commands that may be pending, zero without
+	 * pipelining */
+	int pipeline;
 
 	struct p_data *next;
 };
 
+SLAB_POOL(p_data_pool, struct p_data);
+
 static struct p_data *p_sockets;
 
 static char *p_login;
@@ -62,6 +98,12 @@ static char *p_code;
 static const struct level_ops *p_level;
 static int p_draw_timer;
 static bool p_waiting;
+static bool p_session;
+static int p_linger;
+static int p_linger_timer;
+static bool p_lingering;
+static bool p_idle_reported;
+static struct ratelimit *p_user_limit;
 
 static void proto_pause(void);
 static int p_draw(int fd, int count, void *data);
@@ -71,14 +113,17 @@ static void p_resume_timers();
 /* Deletes the socket if send fails. */
 static int p_send_msg(struct p_data *pd, char *cmd, char *data)
 {
-	char *msg;
+	/* short messages are copied by the socket layer */
+	char local[64];
+	char *msg = local;
 	size_t data_len = 0, msg_len;
 	int ret;
 
 	if (data)
 		data_len = strlen(data) + 1;
 	msg_len = 4 + data_len + (pd->crlf ? 2 : 1);
-	msg = salloc(msg_len);
+	if (msg_len > sizeof(local))
+		msg = salloc(msg_len);
 	memcpy(msg, cmd, 4);
 	if (data) {
 		msg[4] = ' ';
@@ -88,9 +133,10 @@ static int p_send_msg(struct p_data *pd, char *cmd, char *data)
 		memcpy(msg + 4 + data_len, "\r\n", 2);
 	else
 		msg[4 + data_len] = '\n';
-	ret = socket_write(pd->s, msg, msg_len, true);
+	ret = socket_write(pd->s, msg, msg_len, msg != local);
 	if (ret < 0) {
-		sfree(msg);
+		if (msg != local)
+			sfree(msg);
 		socket_del(pd->s);
 	}
 	return ret;
@@ -106,33 +152,159 @@ static int p_send_nope(struct p_data *pd, char *msg)
 	return p_send_msg(pd, "NOPE", msg);
 }
 
-static int p_send_data(struct p_data *pd, void *data, int memb_size, unsigned len)
+/* " 0" to " 255" for the byte values, padded to 4 bytes */
+static char p_byte_str[256][4];
+static unsigned char p_byte_len[256];
+
+static const char p_digits[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static void p_init_byte_str(void)
 {
-	char *msg;
-	size_t size, pos = 0;
-	int ret;
+	char tmp[5];
+
+	for (int i = 0; i < 256; i++) {
+		p_byte_len[i] = sprintf(tmp, " %d", i);
+		memcpy(p_byte_str[i], tmp, 4);
+	}
+}
+
+/* Writes " <n>" to "buf", returns its length. */
+static size_t put_int(char *buf, int n)
+{
+	char tmp[12];
+	char *pos = tmp + sizeof(tmp);
+	unsigned u = n < 0 ? -(unsigned)n : (unsigned)n;
+
+	/* two digits at a time */
+	while (u >= 100) {
+		pos -= 2;
+		memcpy(pos, p_digits + u % 100 * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		pos -= 2;
+		memcpy(pos, p_digits + u * 2, 2);
+	} else {
+		*--pos = '0' + u;
+	}
+	if (n < 0)
+		*--pos = '-';
+	*--pos = ' ';
+	memcpy(buf, pos, tmp + sizeof(tmp) - pos);
+	return tmp + sizeof(tmp) - pos;
+}
 
-	size = len * 12 + 1;
-	msg = salloc(size);
+/* Writes " <n>" for each of the bytes to "buf", which must have room for
+ * 4 bytes per each. Returns the length written. */
+static size_t put_bytes(char *buf, const unsigned char *bytes, unsigned len)
+{
+	size_t pos = 0;
+
+	/* copies 4 bytes, the size has room for that */
 	for (unsigned i = 0; i < len; i++) {
-		int m;
+		memcpy(buf + pos, p_byte_str[bytes[i]], 4);
+		pos += p_byte_len[bytes[i]];
+	}
+	return pos;
+}
 
-		switch (memb_size) {
-		case sizeof(int):
-			m = ((int *)data)[i];
-			break;
-		case 1:
-			m = ((unsigned char *)data)[i];
-			break;
-		default:
-			m = 0;
-		}
-		pos += snprintf(msg + pos, size - pos, " %d", m);
-		if (pos >= size)
-			break;
+/* A DATA response of bytes generated as the socket drains. The bytes are
+ * copied, the buffers returned by the level are reused by the next call. */
+struct p_stream {
+	bool crlf;
+	bool started;
+	unsigned len, pos;
+	unsigned char bytes[];
+};
+
+static size_t p_stream_produce(void *buf, size_t size, bool *done, void *data)
+{
+	struct p_stream *st = data;
+	char *msg = buf;
+	size_t pos = 0;
+	unsigned cnt;
+
+	if (!st->started) {
+		memcpy(msg, "DATA", 4);
+		pos = 4;
+		st->started = true;
+	}
+	/* leave room for EOL */
+	cnt = (size - pos - 2) / 4;
+	if (cnt > st->len - st->pos)
+		cnt = st->len - st->pos;
+	pos += put_bytes(msg + pos, st->bytes + st->pos, cnt);
+	st->pos += cnt;
+	if (st->pos == st->len) {
+		if (st->crlf)
+			msg[pos++] = '\r';
+		msg[pos++] = '\n';
+		*done = true;
+	}
+	return pos;
+}
+
+static int p_send_stream(struct p_data *pd, unsigned char *bytes, unsigned len)
+{
+	struct p_stream *st;
+	int ret;
+
+	st = salloc(sizeof(*st) + len);
+	st->crlf = pd->crlf;
+	st->started = false;
+	st->len = len;
+	st->pos = 0;
+	memcpy(st->bytes, bytes, len);
+	ret = socket_write_producer(pd->s, p_stream_produce, st, sfree,
+				    sizeof(*st) + len);
+	if (ret < 0)
+		socket_del(pd->s);
+	return ret;
+}
+
+/* Builds the message right in the buffer that is queued, long byte
+ * responses are streamed. Deletes the socket if send fails. */
+static int p_send_data(struct p_data *pd, void *data, int memb_size, unsigned len)
+{
+	char local[64];
+	char *msg = local;
+	size_t size, pos;
+	int ret;
+
+	/* "DATA", the numbers each with a space, EOL */
+	size = 4 + (size_t)len * (memb_size == 1 ? 4 : sizeof(" -2147483648") - 1) + 2;
+	if (memb_size == 1 && size > DATA_STREAM_MIN)
+		return p_send_stream(pd, data, len);
+	if (size > sizeof(local))
+		msg = salloc(size);
+	memcpy(msg, "DATA", 4);
+	pos = 4;
+	if (memb_size == 1) {
+		pos += put_bytes(msg + pos, data, len);
+	} else {
+		for (unsigned i = 0; i < len; i++)
+			pos += put_int(msg + pos,
+				       memb_size == sizeof(int) ? ((int *)data)[i] : 0);
+	}
+	if (pd->crlf)
+		msg[pos++] = '\r';
+	msg[pos++] = '\n';
+	ret = socket_write(pd->s, msg, pos, msg != local);
+	if (ret < 0) {
+		if (msg != local)
+			sfree(msg);
+		socket_del(pd->s);
 	}
-	ret = p_send_msg(pd, "DATA", msg + 1);
-	sfree(msg);
 	return ret;
 }
 
@@ -143,6 +315,7 @@ static int p_send_int(struct p_data *pd, int what)
 
 static void p_report_and_close(struct p_data *pd, char *cmd, char *msg)
 {
+	pd->closing = true;
 	check(socket_stop_reading(pd->s));
 	p_send_msg(pd, cmd, msg);
 	socket_flush_and_del(pd->s);
@@ -154,9 +327,10 @@ static void p_report_error(struct p_data *pd, char *msg)
 	p_report_and_close(pd, "OVER", msg);
 }
 
-static void p_report_win(struct p_data *pd, char *msg)
+/* Records the win, returns the message to report: "msg", or the report
+ * stored in "buf" (BUF_SIZE + 1 bytes). */
+static char *p_record_win(char *buf, char *msg)
 {
-	char buf[BUF_SIZE + 1];
 	int res;
 
 	log_info("winner, running: %s %s %s", PLUMBING, p_login, p_code);
@@ -182,120 +356,181 @@ static void p_report_win(struct p_data *pd, char *msg)
 	}
 	if (res < 0)
 		msg = "Vyskytla se neocekavana chyba pri zaznamenavani vysledku.";
+	return msg;
+}
+
+static void p_report_win(struct p_data *pd, char *msg)
+{
+	char buf[BUF_SIZE + 1];
+
+	msg = p_record_win(buf, msg);
 	log_info("closing app socket fd %d", socket_get_fd(pd->s));
 	p_report_and_close(pd, "OVER", msg);
 }
 
-static char *process_msg_chunk(struct p_data *pd, char *buf, size_t count)
+/* Parses a message without the terminating LF. */
+static char *parse_msg(struct p_data *pd, char *buf, size_t len)
 {
-	char *pos;
+	char *pos = buf + CMD_LEN, *end = buf + len;
+
+	for (unsigned i = 0; i < CMD_LEN; i++)
+		if (i == len || buf[i] < 'A' || buf[i] > 'Z')
+			return P_MSG_CMD_NO_LETTER;
+	memcpy(pd->cmd, buf, CMD_LEN);
+	pd->cmd[CMD_LEN] = '\0';
+	pd->crlf = end[-1] == '\r';
+	if (pd->crlf)
+		end--;
+	if (memchr(pos, '\r', end - pos))
+		return P_MSG_INVALID_EOL;
+	/* to be robust, accept also more whitespace between command and
+	 * data */
+	pd->is_val = false;
+	while (pos < end && (*pos == ' ' || *pos == '\t')) {
+		pd->is_val = true;
+		pos++;
+	}
+	if (!pd->is_val && pos < end)
+		return P_MSG_CMD_EXTRA_CHARS;
+	if (memchr(pos, '\0', end - pos))
+		return P_MSG_VAL_CONTAINS_NULL;
+	if (end - pos > pd->val_max)
+		return P_MSG_VAL_TOO_LONG;
+	pd->val_len = end - pos;
+	memcpy(pd->val, pos, pd->val_len);
+	pd->val[pd->val_len] = '\0';
+	return NULL;
+}
 
-	for (pos = buf; pos - buf < (ssize_t)count; pos++) {
-		if (pd->cmd_len < CMD_LEN) {
-			if (*pos < 'A' || *pos > 'Z')
+/* Parses at most one message from "buf", the number of consumed bytes is
+ * stored to "used". An incomplete message is not consumed. */
+static char *parse_span(struct p_data *pd, char *buf, size_t count,
+			size_t *used)
+{
+	char *eol;
+	char *ret;
+
+	*used = 0;
+	if (pd->msg_complete)
+		return NULL;
+	eol = memchr(buf, '\n', count);
+	if (!eol) {
+		/* report errors early, without waiting for the rest */
+		for (unsigned i = 0; i < CMD_LEN && i < count; i++)
+			if (buf[i] < 'A' || buf[i] > 'Z')
 				return P_MSG_CMD_NO_LETTER;
-			pd->cmd[pd->cmd_len++] = *pos;
-			continue;
-		}
-		if (pd->msg_complete)
-			return P_MSG_IMPATIENT;
-		if (pd->expect_lf) {
-			if (*pos != '\n')
-				return P_MSG_INVALID_EOL;
-			pd->expect_lf = false;
-			pd->crlf = true;
-			pd->msg_complete = true;
-			continue;
-		}
-		if (pd->val_len == 0) {
-			pd->cmd[CMD_LEN] = '\0';
-			if (*pos == ' ' || *pos == '\t') {
-				/* to be robust, accept also more whitespace
-				 * between command and data (i.e. don't
-				 * check whether is_val was already set) */
-				pd->is_val = true;
-				continue;
-			}
-			if (!pd->is_val && (*pos != '\r' && *pos != '\n'))
-				return P_MSG_CMD_EXTRA_CHARS;
-		}
-		if (*pos == '\r') {
-			pd->expect_lf = true;
-			continue;
-		}
-		if (*pos == '\n') {
-			pd->crlf = false;
-			pd->msg_complete = true;
-			continue;
-		}
-		if (*pos == '\0')
-			return P_MSG_VAL_CONTAINS_NULL;
-		if (pd->val_len == VAL_LEN)
-			return P_MSG_VAL_TOO_LONG;
-		pd->val[pd->val_len++] = *pos;
-		pd->val[pd->val_len] = '\0';
+		if (count <= MSG_LEN(pd->val_max))
+			return NULL;
+		ret = parse_msg(pd, buf, count);
+		return ret ? ret : P_MSG_VAL_TOO_LONG;
 	}
+	ret = parse_msg(pd, buf, eol - buf);
+	if (ret)
+		return ret;
+	pd->msg_complete = true;
+	*used = eol - buf + 1;
 	return NULL;
 }
 
-static void check_msg_complete(struct p_data *pd)
+/* Returns false if the socket is being closed. */
+static bool check_msg_complete(struct p_data *pd)
 {
 	char *ret;
 
 	if (!pd->msg_complete)
-		return;
+		return true;
 	ret = pd->process(pd);
 	if (ret) {
 		p_report_error(pd, ret);
-		return;
+		return false;
 	}
-	pd->cmd_len = 0;
-	pd->val_len = 0;
 	pd->msg_complete = false;
-	pd->is_val = false;
-	pd->expect_lf = false;
+	return !pd->closing;
 }
 
-static void p_read(struct socket *s, void *data)
+/* Processes the complete messages in the input buffer, in order. Without
+ * pipelining, the client has to wait for the response before sending
+ * anything more; with it, up to pd->pipeline commands may be pending.
+ * USER and LEVL are not counted. The commands following WAIT are left in
+ * the buffer until the level is resumed. */
+static void p_process_input(struct p_data *pd)
 {
-	struct p_data *pd = data;
-	char buf[BUF_SIZE];
-	size_t count;
-	char *ret;
-
-	while (true) {
-		count = socket_read(s, buf, BUF_SIZE);
-		if (!count)
-			break;
-		ret = process_msg_chunk(pd, buf, count);
+	size_t count, used;
+	char *buf, *ret;
+	int pending = 0;
+
+	while (!pd->closing && !(pd->bound && p_waiting)) {
+		buf = socket_input(pd->s, &count);
+		ret = parse_span(pd, buf, count, &used);
+		if (!ret && !pd->msg_complete)
+			return;
+		if (!ret && pd->bound) {
+			pending++;
+			if (!pd->pipeline && used < count)
+				ret = P_MSG_IMPATIENT;
+			else if (pd->pipeline && pending > pd->pipeline)
+				ret = P_MSG_PIPE_TOO_MANY;
+		}
 		if (ret) {
 			p_report_error(pd, ret);
 			return;
 		}
+		socket_consume(pd->s, used);
+		if (!check_msg_complete(pd))
+			return;
 	}
-	check_msg_complete(pd);
 }
 
-static bool get_2_int(char *val, int *res1, int *res2)
+static void p_read(struct socket *s, void *data)
+{
+	struct p_data *pd = data;
+
+	while (!pd->closing && socket_fill(s))
+		p_process_input(pd);
+}
+
+/* Processes the bytes read by the master after USER, i.e. LEVL and
+ * possibly commands. A partial message is left in the input buffer for
+ * p_read. */
+static void p_replay(struct p_data *pd, char *buf, size_t count)
+{
+	socket_push_input(pd->s, buf, count);
+	p_process_input(pd);
+}
+
+static bool get_ints(char *val, int *res, int count)
 {
 	char *ptr = val;
-	long int res;
+	long int n;
 
-	for (int i = 0; i < 2; i++) {
+	for (int i = 0; i < count; i++) {
 		errno = 0;
-		res = strtol(ptr, &ptr, 10);
+		n = strtol(ptr, &ptr, 10);
 		if (errno)
 			return false;
-		if (res < 0 || res > INT_MAX)
+		if (n < 0 || n > INT_MAX)
 			return false;
-		if (i == 0)
-			*res1 = res;
-		else
-			*res2 = res;
+		res[i] = n;
 	}
 	return true;
 }
 
+/* The default for levels without the area callback. */
+static char *p_area(void *data, int x, int y, int w, int h, unsigned char *res)
+{
+	char *nope;
+	int color;
+
+	for (int i = 0; i < h; i++)
+		for (int j = 0; j < w; j++) {
+			nope = p_level->what(data, x + j, y + i, &color);
+			if (nope)
+				return nope;
+			*res++ = color;
+		}
+	return NULL;
+}
+
 static char *process_cmd(struct p_data *pd)
 {
 	char *nope = NULL;
@@ -322,14 +557,79 @@ static char *process_cmd(struct p_data *pd)
 			p_report_error(pd, nope);
 			return NULL;
 		}
+	} else if (!strcmp(pd->cmd, "MOVS")) {
+		char msg[BUF_SIZE];
+		int res = MOVE_OKAY;
+		unsigned done;
+
+		if (!pd->val_len)
+			return P_MSG_CHARS_EXPECTED;
+		/* stops at the first move that is not okay */
+		for (done = 0; done < pd->val_len; done++) {
+			res = p_level->move(pd->data, pd->val[done], &nope);
+			if (res != MOVE_OKAY)
+				break;
+		}
+		/* every reply starts with the number of the performed moves,
+		 * including the one ending the level */
+		if (res == MOVE_WIN || res == MOVE_LOSE)
+			done++;
+		switch (res) {
+		case MOVE_OKAY:
+			nope = NULL;
+			snprintf(msg, sizeof(msg), "%u", done);
+			p_send_msg(pd, "DONE", msg);
+			break;
+		case MOVE_BAD:
+			snprintf(msg, sizeof(msg), "%u %s", done, nope);
+			nope = NULL;
+			p_send_nope(pd, msg);
+			break;
+		case MOVE_WIN: {
+			char buf[BUF_SIZE + 1];
+
+			snprintf(msg, sizeof(msg), "%u %s", done,
+				 p_record_win(buf, nope));
+			log_info("closing app socket fd %d", socket_get_fd(pd->s));
+			p_report_and_close(pd, "OVER", msg);
+			return NULL;
+		}
+		case MOVE_LOSE:
+			snprintf(msg, sizeof(msg), "%u %s", done, nope);
+			p_report_error(pd, msg);
+			return NULL;
+		}
 	} else if (!strcmp(pd->cmd, "WHAT")) {
-		int x, y, res;
+		int xy[2], res;
 
-		if (!get_2_int(pd->val, &x, &y))
+		if (!get_ints(pd->val, xy, 2))
 			return P_MSG_2INT_EXPECTED;
-		nope = p_level->what(pd->data, x, y, &res);
+		nope = p_level->what(pd->data, xy[0], xy[1], &res);
 		if (!nope)
 			p_send_int(pd, res);
+	} else if (!strcmp(pd->cmd, "AREA")) {
+		static unsigned char *buf;
+		static unsigned buf_size;
+		int r[4];
+		unsigned size;
+
+		if (!get_ints(pd->val, r, 4))
+			return P_MSG_4INT_EXPECTED;
+		if (!r[2] || !r[3] || (long)r[2] * r[3] > AREA_MAX)
+			return P_MSG_AREA_SIZE;
+		size = r[2] * r[3];
+		if (size > buf_size) {
+			buf = srealloc(buf, size);
+			buf_size = size;
+		}
+		if (r[0] > INT_MAX - r[2] || r[1] > INT_MAX - r[3])
+			nope = A_MSG_OUT_OF_MAZE;
+		else if (p_level->area)
+			nope = p_level->area(pd->data, r[0], r[1], r[2], r[3], buf);
+		else
+			nope = p_area(pd->data, r[0], r[1], r[2], r[3], buf);
+		if (!nope)
+			p_send_data(pd, buf, 1, size);
 	} else if (!strcmp(pd->cmd, "MAZE")) {
 		unsigned char *res;
 		unsigned len;
@@ -377,11 +677,11 @@ static char *process_cmd(struct p_data *pd)
 		if (pd->is_val)
 			return P_MSG_EXTRA_PARAM;
 
-		/* The response will be queued but won't be send until the
-		 * socket is enabled. */
-		p_send_ack(pd);
-
+		/* Pause first, the response will be then queued but won't
+		 * be sent until the socket is enabled. */
 		proto_pause();
+
+		p_send_ack(pd);
 	} else {
 		return P_MSG_CMD_UNKNOWN;
 	}
@@ -403,6 +703,14 @@ static bool valid_identifier(char *val)
 	return true;
 }
 
+/* Zero means the default, negative no limit. */
+static int p_limit(int value, int def)
+{
+	if (!value)
+		return def;
+	return value < 0 ? 0 : value;
+}
+
 static char *start_level(char *code)
 {
 	p_level = app_get_level(code);
@@ -412,28 +720,59 @@ static char *start_level(char *code)
 	}
 	log_info("level \"%s\"", code);
 	p_code = sstrdup(code);
+	ratelimit_set(p_user_limit, p_limit(p_level->user_rate, USER_RATE),
+		      p_limit(p_level->user_bucket, USER_BUCKET_SIZE));
+	if (p_draw_timer < 0) {
+		p_draw_timer = timer_new(p_draw, NULL, NULL);
+		check(p_draw_timer);
+		timer_arm(p_draw_timer, REDRAW_INTERVAL, true);
+	}
+	draw_button(BUTTON_KILL, true);
+	return NULL;
+}
+
+/* A session starts with the first bound socket; with lingering, the level
+ * may serve several sessions. */
+static void start_session(void)
+{
 	p_bound_max = p_level->max_conn;
 	time_from_now(&p_can_pause_until, CAN_PAUSE_INTERVAL);
 	if (p_level->max_time) {
 		time_from_now(&p_end, p_level->max_time * 1000);
 		p_end_set = true;
 	}
-	p_draw_timer = timer_new(p_draw, NULL, NULL);
-	check(p_draw_timer);
-	timer_arm(p_draw_timer, REDRAW_INTERVAL, true);
-	draw_button(BUTTON_KILL, true);
-	return NULL;
+	p_session = true;
 }
 
 static char *process_level(struct p_data *pd)
 {
+	char *depth, *end;
+	long pipeline = 0;
+
 	if (strcmp(pd->cmd, "LEVL"))
 		return P_MSG_LEVL_EXPECTED;
+	/* the code may be followed by the requested pipeline depth */
+	depth = pd->val + strcspn(pd->val, " \t");
+	if (*depth) {
+		*depth++ = '\0';
+		errno = 0;
+		pipeline = strtol(depth, &end, 10);
+		if (errno || end == depth || *end || pipeline < 1)
+			return P_MSG_PIPE_BAD;
+	}
 	if (!valid_identifier(pd->val))
 		return P_MSG_LEVL_BAD_CHARS;
-
-	if (p_code && strcmp(pd->val, p_code))
-		return P_MSG_LEVL_NOT_MATCHING;
+	/* VAL_LEN fits MOVS, the level paths fit only LOGIN_LEN */
+	if (strlen(pd->val) > LOGIN_LEN)
+		return P_MSG_VAL_TOO_LONG;
+
+	if (p_code && strcmp(pd->val, p_code)) {
+		if (p_session)
+			return P_MSG_LEVL_NOT_MATCHING;
+		/* lingering with another level loaded */
+		sfree(p_code);
+		p_code = NULL;
+	}
 	if (p_bound_count >= p_bound_max)
 		return P_MSG_CONN_TOO_MANY;
 
@@ -443,22 +782,45 @@ static char *process_level(struct p_data *pd)
 		res = start_level(pd->val);
 		if (res)
 			return res;
+	} else if (!p_session) {
+		log_info("reusing level \"%s\"", p_code);
 	}
+	if (!p_session)
+		start_session();
 	if (p_level->get_data)
 		pd->data = p_level->get_data();
+	socket_set_ratelimit(pd->s, p_limit(p_level->rate, RATE),
+			     p_limit(p_level->bucket, BUCKET_SIZE), p_user_limit);
 	pd->bound = true;
 	pd->process = process_cmd;
-	p_bound_count++;
+	if (!p_bound_count++ && p_idle_reported) {
+		ipc_report_idle(false);
+		p_idle_reported = false;
+	}
 	level_dirty();
 
-	p_send_ack(pd);
 	if (p_waiting)
 		socket_pause(pd->s, true);
+	if (pipeline) {
+		int max = p_limit(p_level->pipeline, PIPELINE);
+
+		/* the granted depth, one if disabled */
+		pd->pipeline = pipeline < max ? pipeline : max;
+		if (!pd->pipeline)
+			pd->pipeline = 1;
+		socket_set_nodelay(pd->s);
+		p_send_int(pd, pd->pipeline);
+	} else {
+		p_send_ack(pd);
+	}
 	return NULL;
 }
 
 static char *process_user(struct p_data *pd)
 {
+	void *rest;
+	size_t rest_len;
+
 	if (strcmp(pd->cmd, "USER"))
 		return P_MSG_USER_EXPECTED;
 
@@ -467,7 +829,13 @@ static char *process_user(struct p_data *pd)
 		return P_MSG_USER_UNKNOWN;
 	}
 
-	ipc_send_socket(pd->val, pd->s, pd->crlf ? IPC_FD_APP_CRLF : IPC_FD_APP_LF);
+	/* the bytes read after USER, see p_read */
+	rest = socket_input(pd->s, &rest_len);
+	if (ipc_send_socket(pd->val, pd->s,
+			    pd->crlf ? IPC_FD_APP_CRLF : IPC_FD_APP_LF,
+			    rest, rest_len) < 0)
+		return P_MSG_VAL_TOO_LONG;
+	pd->closing = true;
 	return NULL;
 }
 
@@ -475,9 +843,15 @@ static void *p_server_new(struct socket *s)
 {
 	struct p_data *pd;
 
-	pd = szalloc(sizeof(*pd));
+	pd = slab_zalloc(&p_data_pool);
 	pd->s = s;
 	pd->process = process_user;
+	pd->val_max = LOGIN_LEN;
+	/* the data read after USER is passed to the child, see
+	 * process_user */
+	socket_set_input_max(s, IPC_DATA_MAX);
+	socket_set_ratelimit(s, RATE, BUCKET_SIZE, NULL);
+	socket_set_handshake_deadline(s, HANDSHAKE_TIMEOUT, HANDSHAKE_MIN_RATE);
 	return pd;
 }
 
@@ -485,15 +859,29 @@ static void p_server_free(void *data)
 {
 	struct p_data *pd = data;
 
-	sfree(pd);
+	slab_free(&p_data_pool, pd);
 }
 
 int proto_server_init(unsigned port)
 {
+	socket_set_process_ratelimit(SERVER_RATE, SERVER_BUCKET_SIZE);
 	return socket_listen(port, p_server_new, p_read, p_server_free);
 }
 
-void proto_client_init(char *login, proto_close_cb_t close_cb)
+int proto_server_init_unix(const char *path)
+{
+	socket_set_process_ratelimit(SERVER_RATE, SERVER_BUCKET_SIZE);
+	return socket_listen_unix(path, p_server_new, p_read, p_server_free);
+}
+
+static int p_linger_expired(int fd __unused, int count __unused, void *data __unused)
+{
+	log_info("no connection in %d ms, terminating", p_linger);
+	p_close_cb();
+	return 0;
+}
+
+void proto_client_init(char *login, proto_close_cb_t close_cb, int linger)
 {
 	p_sockets = NULL;
 	p_login = login;
@@ -504,13 +892,57 @@ void proto_client_init(char *login, proto_close_cb_t close_cb)
 	p_end_set = false;
 	p_code = NULL;
 	p_level = NULL;
+	p_draw_timer = -1;
 	p_waiting = false;
+	p_session = false;
+	p_linger = linger;
+	p_lingering = false;
+	p_idle_reported = false;
+	p_user_limit = ratelimit_new(USER_RATE, USER_BUCKET_SIZE);
+	p_init_byte_str();
+	if (linger) {
+		p_linger_timer = timer_new(p_linger_expired, NULL, NULL);
+		check(p_linger_timer);
+	}
 }
 
-void proto_cond_close(void)
+/* Ends the session and terminates, unless the level can be kept for the
+ * next session. */
+static void p_close(void)
 {
-	if (!p_count && p_close_cb)
+	struct p_data *pd;
+
+	if (!p_close_cb)
+		return;
+	if (!p_linger || !p_code) {
 		p_close_cb();
+		return;
+	}
+	/* the remaining sockets go with the session, the child lingers once
+	 * they are all freed */
+	for (pd = p_sockets; pd; pd = pd->next)
+		socket_del(pd->s);
+	p_session = false;
+	if (p_count || p_lingering)
+		return;
+	proto_resume();
+	p_lingering = true;
+	timer_arm(p_linger_timer, p_linger, false);
+	log_info("session ended, lingering for %d ms", p_linger);
+}
+
+static void p_stop_lingering(void)
+{
+	if (!p_lingering)
+		return;
+	timer_disarm(p_linger_timer);
+	p_lingering = false;
+}
+
+void proto_cond_close(void)
+{
+	if (!p_count)
+		p_close();
 }
 
 static void p_free(void *data)
@@ -525,37 +957,47 @@ static void p_free(void *data)
 		*ptr = pd->next;
 	p_count--;
 
-	if (bound)
-		p_bound_count--;
-	if (p_level && p_level->free_data)
+	if (bound && !--p_bound_count) {
+		/* the master may terminate us now if it needs room */
+		ipc_report_idle(true);
+		p_idle_reported = true;
+	}
+	if (bound && p_level->free_data)
 		p_level->free_data(pd->data);
 	p_server_free(data);
-	if ((!p_count || bound) && p_close_cb)
-		p_close_cb();
+	if (!p_count || bound)
+		p_close();
 }
 
-int proto_client_add(int fd, bool crlf)
+int proto_client_add(int fd, bool crlf, char *data, size_t len)
 {
 	struct p_data *pd;
+	int ret;
 
-	pd = szalloc(sizeof(*pd));
+	pd = slab_zalloc(&p_data_pool);
 
 	pd->s = socket_add(fd, p_read, pd, p_free);
 	if (!pd->s) {
-		sfree(pd);
+		slab_free(&p_data_pool, pd);
 		close(fd);
 		return -ENOTSOCK;
 	}
-	socket_set_ratelimit(pd->s);
+	socket_set_ratelimit(pd->s, RATE, BUCKET_SIZE, p_user_limit);
 
 	pd->process = process_level;
+	pd->val_max = VAL_LEN;
 	pd->crlf = crlf;
 
 	pd->next = p_sockets;
 	p_sockets = pd;
 	p_count++;
+	p_stop_lingering();
 
-	return p_send_ack(pd);
+	ret = p_send_ack(pd);
+	if (ret < 0)
+		return ret;
+	p_replay(pd, data, len);
+	return 0;
 }
 
 static void p_pause_sockets(bool pause)
@@ -586,6 +1028,8 @@ static void proto_pause(void)
 
 void proto_resume(void)
 {
+	struct p_data *pd;
+
 	if (!p_waiting)
 		return;
 	p_waiting = false;
@@ -594,6 +1038,10 @@ void proto_resume(void)
 	if (p_end_set && p_paused_time)
 		time_from_now(&p_end, p_paused_time);
 	p_resume_timers();
+	/* the commands read before the pause */
+	for (pd = p_sockets; pd && !p_waiting; pd = pd->next)
+		if (pd->bound)
+			p_process_input(pd);
 }
 
 static int p_draw(int fd __unused, int count __unused, void *data __unused)
@@ -1,18 +1,26 @@
 #ifndef PROTO_H
 #define PROTO_H
 #include <stdbool.h>
+#include <stddef.h>
 
 /* called when the last app socket is closed or when a bound app socket with
- * protocol error is closed */
+ * protocol error is closed; with lingering, when the linger period expires */
 typedef void (*proto_close_cb_t)(void);
 
 int proto_server_init(unsigned port);
-void proto_client_init(char *login, proto_close_cb_t close_cb);
+/* Listens on a Unix domain socket, see socket_listen_unix. */
+int proto_server_init_unix(const char *path);
 
-/* Closes the fd even if unsuccessful. */
-int proto_client_add(int fd, bool crlf);
+/* If "linger" is not 0, the loaded level is kept for "linger" ms after the
+ * last app socket is closed, a new LEVL with the same code then reuses it. */
+void proto_client_init(char *login, proto_close_cb_t close_cb, int linger);
 
-/* Calls the close callback if there is no app socket open. */
+/* Closes the fd even if unsuccessful. "data" are the bytes the master read
+ * after USER, they are processed first. */
+int proto_client_add(int fd, bool crlf, char *data, size_t len);
+
+/* Calls the close callback (or starts lingering) if there is no app socket
+ * open. */
 void proto_cond_close(void);
 
 void proto_resume(void);
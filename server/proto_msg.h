@@ -11,13 +11,19 @@
 #define P_MSG_VAL_TOO_LONG	"Zprava je prilis dlouha. Nechybi ti nekde znak konce radku?"
 #define P_MSG_USER_EXPECTED	"Komunikace musi zacit prikazem USER."
 #define P_MSG_USER_UNKNOWN	"Tento uzivatel neexistuje."
+#define P_MSG_BUSY		"Server je pretizeny. Zkus to prosim za chvili znovu."
 #define P_MSG_LEVL_EXPECTED	"Druhy prikaz komunikace musi byt LEVL."
 #define P_MSG_LEVL_BAD_CHARS	"Kod levelu smi obsahovat jen mala pismena a cislice."
 #define P_MSG_LEVL_NOT_MATCHING	"Jiz bezi spojeni pro jinou ulohu. Nelze resit dve ulohy najednou."
 #define P_MSG_LEVL_UNKNOWN	"Uloha s timto kodem neexistuje."
+#define P_MSG_PIPE_BAD		"Za kodem ulohy muze nasledovat jen kladne cislo, pocet prikazu odesilanych bez cekani na odpoved."
+#define P_MSG_PIPE_TOO_MANY	"Posilas najednou vice prikazu, nez bylo dohodnuto v prikazu LEVL. Pockej na odpovedi serveru."
 #define P_MSG_TIMEOUT		"Vyprsel cas pro reseni teto ulohy."
 #define P_MSG_CHAR_EXPECTED	"Tento prikaz ocekava jako parametr jeden znak."
+#define P_MSG_CHARS_EXPECTED	"Tento prikaz ocekava jako parametr posloupnost znaku."
 #define P_MSG_2INT_EXPECTED	"Tento prikaz ocekava jako parametr dve nezaporna cisla."
+#define P_MSG_4INT_EXPECTED	"Tento prikaz ocekava jako parametr ctyri nezaporna cisla."
+#define P_MSG_AREA_SIZE		"Oblast musi mit kladne rozmery a nejvyse 65536 policek."
 #define P_MSG_EXTRA_PARAM	"Tento prikaz se vola bez parametru."
 #define P_MSG_MAZE_NOT_AVAIL	"V teto uloze nelze ziskat data o celem hracim poli. Pouzij prikaz WHAT."
 
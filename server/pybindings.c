@@ -1,8 +1,12 @@
 #include <Python.h>
 #include "pybindings.h"
+#include <dirent.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "common.h"
 #include "config.h"
 #include "draw.h"
@@ -23,6 +27,9 @@ static PyObject *nope_exc, *win_exc, *lose_exc;
 static struct data_list *data_list;
 static int data_list_cnt;
 
+/* level code objects compiled by pyb_preload, indexed by path */
+static PyObject *compiled;
+
 #define ERR_MSG_SIZE	128
 static char err_msg[ERR_MSG_SIZE];
 
@@ -549,6 +556,30 @@ static char *pyb_maze(void *data, unsigned char **res, unsigned *len)
 	return NULL;
 }
 
+static char *pyb_area(void *data, int x, int y, int w, int h, unsigned char *res)
+{
+	struct data_list *d = data;
+	Py_ssize_t seqlen;
+
+	PyObject *seqret = PyObject_CallMethod(d->obj, "area", "iiii", x, y, w, h);
+	if (nope_check(seqret))
+		return exc_err();
+	PyObject *seq = c(PySequence_Fast(seqret, "the area method must return a sequence"));
+	seqlen = PySequence_Fast_GET_SIZE(seq);
+	if (seqlen != (Py_ssize_t)w * h) {
+		PyErr_SetString(PyExc_ValueError, "the area method returned a sequence of a wrong length");
+		fatal();
+	}
+
+	for (Py_ssize_t i = 0; i < seqlen; i++) {
+		PyObject *o = PySequence_Fast_GET_ITEM(seq, i);
+		res[i] = to_long(o);
+	}
+	Py_DECREF(seq);
+	Py_DECREF(seqret);
+	return NULL;
+}
+
 static char *pyb_get(void *data, const char *attr, int *res)
 {
 	struct data_list *d = data;
@@ -604,6 +635,7 @@ static struct level_ops ops = {
 	.move = pyb_move,
 	.what = pyb_what,
 	.maze = pyb_maze,
+	.area = pyb_area,
 	.get_x = pyb_get_x,
 	.get_y = pyb_get_y,
 	.get_w = pyb_get_w,
@@ -615,8 +647,23 @@ static void set_level_parms(void)
 {
 	PyObject *max_conn = c(PyObject_GetAttrString(level_cls, "max_conn"));
 	PyObject *max_time = c(PyObject_GetAttrString(level_cls, "max_time"));
+	PyObject *rate = c(PyObject_GetAttrString(level_cls, "rate"));
+	PyObject *bucket = c(PyObject_GetAttrString(level_cls, "bucket"));
+	PyObject *user_rate = c(PyObject_GetAttrString(level_cls, "user_rate"));
+	PyObject *user_bucket = c(PyObject_GetAttrString(level_cls, "user_bucket"));
+	PyObject *pipeline = c(PyObject_GetAttrString(level_cls, "pipeline"));
 	ops.max_conn = to_long(max_conn);
 	ops.max_time = to_long(max_time);
+	ops.rate = to_long(rate);
+	ops.bucket = to_long(bucket);
+	ops.user_rate = to_long(user_rate);
+	ops.user_bucket = to_long(user_bucket);
+	ops.pipeline = to_long(pipeline);
+	Py_DECREF(pipeline);
+	Py_DECREF(user_bucket);
+	Py_DECREF(user_rate);
+	Py_DECREF(bucket);
+	Py_DECREF(rate);
 	Py_DECREF(max_time);
 	Py_DECREF(max_conn);
 }
@@ -655,6 +702,7 @@ static bool pyb_init()
 struct level_ops *pyb_load(const char *path)
 {
 	FILE *f;
+	PyObject *code, *o;
 
 	f = fopen(path, "r");
 	if (!f) {
@@ -662,12 +710,21 @@ struct level_ops *pyb_load(const char *path)
 		return NULL;
 	}
 
-	log_info("python: importing %s", path);
-	Py_SetProgramName(to_wchar(path));
-	if (!pyb_init(path))
-		return NULL;
-
-	PyObject *o = c(PyRun_FileEx(f, path, Py_file_input, globals, globals, true));
+	code = compiled ? PyDict_GetItemString(compiled, path) : NULL;
+	if (code) {
+		/* forked from a preloaded process */
+		log_info("python: running precompiled %s", path);
+		fclose(f);
+		o = c(PyEval_EvalCode(code, globals, globals));
+	} else {
+		log_info("python: importing %s", path);
+		if (!Py_IsInitialized()) {
+			Py_SetProgramName(to_wchar(path));
+			if (!pyb_init(path))
+				return NULL;
+		}
+		o = c(PyRun_FileEx(f, path, Py_file_input, globals, globals, true));
+	}
 	Py_DECREF(o);
 
 	if (!level_cls) {
@@ -679,6 +736,101 @@ struct level_ops *pyb_load(const char *path)
 	return &ops;
 }
 
+static void compile_level(const char *path)
+{
+	FILE *f;
+	char *buf;
+	long len;
+	PyObject *code;
+
+	if (PyDict_GetItemString(compiled, path))
+		/* more codes for the same file */
+		return;
+	f = fopen(path, "r");
+	if (!f) {
+		log_err("cannot open %s", path);
+		return;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = salloc(len + 1);
+	len = fread(buf, 1, len, f);
+	buf[len] = '\0';
+	fclose(f);
+
+	code = Py_CompileString(buf, path, Py_file_input);
+	sfree(buf);
+	if (!code) {
+		/* reported once the level is actually loaded */
+		log_warn("python: cannot compile %s", path);
+		PyErr_Clear();
+		return;
+	}
+	cz(PyDict_SetItemString(compiled, path, code));
+	Py_DECREF(code);
+}
+
+void pyb_preload(void)
+{
+	char path[PATH_MAX];
+	char sl[NAME_MAX + 1];
+	DIR *dir;
+	struct dirent *de;
+	PyObject *o;
+	size_t pos;
+	ssize_t len;
+
+	if (compiled)
+		/* already done, e.g. forked from the zygote */
+		return;
+	if (!pyb_init())
+		exit(1);
+	o = c(PyImport_ImportModule("mazec"));
+	Py_DECREF(o);
+
+	compiled = c(PyDict_New());
+	dir = opendir(PYLEVELS_DIR);
+	if (!dir) {
+		log_err("cannot open %s", PYLEVELS_DIR);
+		exit(1);
+	}
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "code_", 5))
+			continue;
+		/* the same path as computed by the app */
+		pos = strlcpy(path, PYLEVELS_DIR, sizeof(path));
+		strlcpy(path + pos, de->d_name, sizeof(path) - pos);
+		len = readlink(path, sl, sizeof(sl) - 1);
+		if (len < 0)
+			continue;
+		sl[len] = '\0';
+		strlcpy(path + pos, sl, sizeof(path) - pos);
+		compile_level(path);
+	}
+	closedir(dir);
+	log_info("python: %zd levels precompiled", PyDict_Size(compiled));
+
+	/* keep the preloaded objects out of the collections in the children,
+	 * their pages then stay shared */
+	o = c(PyImport_ImportModule("gc"));
+	Py_DECREF(c(PyObject_CallMethod(o, "freeze", NULL)));
+	Py_DECREF(o);
+}
+
+pid_t pyb_fork(void)
+{
+	pid_t pid;
+
+	PyOS_BeforeFork();
+	pid = fork();
+	if (pid)
+		PyOS_AfterFork_Parent();
+	else
+		PyOS_AfterFork_Child();
+	return pid;
+}
+
 void pyb_interactive(void)
 {
 	if (!pyb_init())
@@ -1,8 +1,17 @@
 #ifndef PYBIDNINGS_H
 #define PYBIDNINGS_H
+#include <sys/types.h>
 #include "level.h"
 
 struct level_ops *pyb_load(const char *path);
 void pyb_interactive();
 
+/* Initializes the interpreter, imports the mazec module and compiles all
+ * Python levels, so that processes forked afterwards can load a level
+ * quickly. */
+void pyb_preload(void);
+
+/* Forks the process, keeping the interpreter state consistent. */
+pid_t pyb_fork(void);
+
 #endif
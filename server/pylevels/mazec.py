@@ -6,12 +6,21 @@ class BaseLevel:
        set_level(code, class). For multiple connections, each connection
        gets its own object.
 
-       The base class has two class attributes:
+       The base class has these class attributes:
 
        max_conn: Specifies the maximum number of concurrent connections to this
                  level.
        max_time: Specifies the maximum number of seconds that are available
                  to solve the level.
+       rate, bucket: The rate limit of the data sent to each connection in
+                     bytes per second and the maximum burst in bytes.
+       user_rate, user_bucket: The same for all connections of the user
+                               together.
+       For the rate limits, 0 means the default and a negative value means
+       no limit.
+       pipeline: The maximum number of commands a client may send without
+                 waiting for the responses, if it asks for it. 0 means the
+                 default, a negative value disables pipelining.
 
        Subclasses must define these attributes, either as class or object
        attributes:
@@ -34,6 +43,11 @@ class BaseLevel:
 
     max_conn = 1
     max_time = 0
+    rate = 0
+    bucket = 0
+    user_rate = 0
+    user_bucket = 0
+    pipeline = 0
 
     def move(self, key):
         """Called to perform a move. The key parameter is a string containing the key
@@ -48,6 +62,12 @@ class BaseLevel:
         """Should return the whole maze as an iterable of w * h integers or raise Nope."""
         raise Nope("Neni podporovano")
 
+    def area(self, x, y, w, h):
+        """Should return the w * h rectangle with the top left corner on x, y as
+           a sequence of integers, row by row, or raise Nope. By default, calls
+           what for each item; override it when there's a faster way."""
+        return [self.what(i, j) for j in range(y, y + h) for i in range(x, x + w)]
+
     @classmethod
     def redraw(cls, objs):
         """Called to redraw the remote screen. May be called even when the level did
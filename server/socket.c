@@ -2,63 +2,173 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
 #include "common.h"
 #include "event.h"
 #include "log.h"
 #include "time.h"
 
+struct sbuf {
+	int refs;
+	size_t size;
+	char data[];
+};
+
+/* copied messages up to this size are stored in struct msg itself */
+#define MSG_SMALL	48
+
 struct msg {
+	/* points to shared->data for shared buffers and to small for small
+	 * copied messages */
 	void *buf;
+	struct sbuf *shared;
 	size_t size, start;
 	void *ancil_buf;
 	size_t ancil_size;
-	int fd_to_close;
+	bool close_fds;
+	/* set for producer messages, see socket_write_producer; "size" is
+	 * then the memory held by the producer */
+	socket_produce_t produce;
+	void *produce_data;
+	cb_data_destructor_t produce_destructor;
 	struct msg *next;
+	char small[MSG_SMALL];
 };
 
+SLAB_POOL(msg_pool, struct msg);
+
+/* A token bucket. The buckets form a hierarchy: a message is sent only
+ * when the socket's bucket and all its ancestors allow it, and it is
+ * charged to all of them. */
+struct ratelimit {
+	long rate;		/* in bytes per second, zero for no limit */
+	long size;		/* in bytes */
+	/* Can be negative: a message larger than the bucket is sent once
+	 * the bucket is full, leaving a debt. */
+	long tokens;
+	struct timespec last_refill;
+	struct ratelimit *parent;
+};
+
+/* the request armed for reading, see socket_sync_input */
+enum { RECV_NONE, RECV_DATA, RECV_POLL, RECV_ACCEPT };
+
 struct socket {
 	int refs;
 	int fd;
-	int rate_limit_timer;
 	bool dead;
+	bool paused;
 	bool should_close;
-	bool rate_limit_okay;
-	struct timespec last_xmit;
+	bool rate_limited;
+	bool stream;
+	bool reading_stopped;
+	bool backpressure;
+	struct ratelimit limit;
+	/* waiting for tokens, see socket_throttle */
+	struct timespec throttled_until;
+	struct socket *throttled_next;
+	struct socket **throttled_pprev;
+	/* the remote address of accepted connections */
+	struct peer *peer;
+	/* handshake deadline, see socket_set_handshake_deadline */
+	struct timespec accepted;
+	int handshake_msec;
+	int handshake_min_rate;
+	size_t rx_bytes;
+	struct socket *handshake_next;
+	struct socket **handshake_pprev;
 	socket_cb_read_t cb_read;
 	socket_cb_read_t cb_write_done;
 	void *cb_data;
 	cb_data_destructor_t cb_destructor;
 	struct msg *wqueue;
-	int wqueue_len;
+	struct msg **wqueue_tail;
+	size_t wqueue_bytes;
+	/* input buffer, see socket_fill */
+	char *in_buf;
+	size_t in_size, in_start, in_len, in_max;
+	size_t in_peak;
+	int in_small;
+	/* completion based I/O, see socket_sync_input */
+	bool uring;
+	bool listener;
+	bool recv_cancelled;
+	int recv_state;
+	struct event_op recv_op;
+	/* received but not returned by socket_fill yet */
+	size_t in_new;
+	struct send_chain *sending;
+	bool kicked;
+	struct socket *kick_next;
 };
 
-#define WQUEUE_MAX_LEN	20
+SLAB_POOL(socket_pool, struct socket);
 
-/* Token bucket rate limiter values: */
-#define RATE		12000	/* in bytes per second */
-#define BUCKET_SIZE	60000	/* in bytes */
+/* Input buffer sizes, in bytes. The buffer of a stream socket starts at
+ * IBUF_MIN and doubles when more than half of it is taken by a partial
+ * message, up to the socket's maximum. It's halved after IBUF_SHRINK read
+ * events that used less than a quarter of it. Sockets with message
+ * boundaries get a buffer of their maximum size right away. */
+#define IBUF_MIN	1024
+#define IBUF_MAX	(64 * 1024)
+#define IBUF_PACKET	4096
+#define IBUF_SHRINK	16
+
+struct ibuf_min {
+	char data[IBUF_MIN];
+};
+
+SLAB_POOL(ibuf_pool, struct ibuf_min);
+
+/* Write queue limits, in bytes. Above WQUEUE_HIGH, the socket is not read
+ * until the queue drains below WQUEUE_LOW: a peer that does not read the
+ * responses does not get more requests processed. Writes fail once more
+ * than WQUEUE_MAX is queued; a single message may be larger. */
+#define WQUEUE_LOW	(16 * 1024)
+#define WQUEUE_HIGH	(64 * 1024)
+#define WQUEUE_MAX	(1024 * 1024)
+/* The size of the chunks generated by producer messages. Without a rate
+ * limit, the data can usually be sent right away and larger chunks save
+ * the round trips through the write queue. */
+#define PRODUCE_CHUNK		WQUEUE_HIGH
+#define PRODUCE_CHUNK_FAST	WQUEUE_MAX
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
 
 static void socket_process_wqueue(struct socket *s);
+static bool socket_sent(struct socket *s, ssize_t written, int cnt);
 static void socket_del_wqueue(struct socket *s);
-
-static bool rate_limited(struct socket *s)
-{
-	return s->rate_limit_timer >= 0;
-}
+static void socket_unthrottle(struct socket *s);
+static void peer_release(struct peer *p);
+static void socket_handshake_done(struct socket *s);
+static void ibuf_check_shrink(struct socket *s);
+static void socket_produce(struct socket *s, struct msg **pp);
+static void socket_recv_done(struct event_op *op, int res, unsigned flags);
+static void socket_kick(struct socket *s);
+static void socket_uring_del(struct socket *s);
 
 static int socket_cb(int fd, unsigned events, void *data)
 {
 	struct socket *s = data;
 
-	if (events & EV_READ)
+	if (events & EV_READ) {
 		s->cb_read(s, s->cb_data);
+		ibuf_check_shrink(s);
+	}
 	if (events & EV_ERROR) {
 		log_info("socket %d was closed by the other side", fd);
 		socket_del(s);
@@ -69,22 +179,13 @@ static int socket_cb(int fd, unsigned events, void *data)
 	return 0;
 }
 
-static int socket_ratelimit_cb(int fd __unused, int count __unused, void *data)
-{
-	struct socket *s = data;
-
-	event_change_fd_add(s->fd, EV_WRITE);
-	s->rate_limit_okay = true;
-	return 0;
-}
-
 static void socket_kill(void *data)
 {
 	struct socket *s = data;
 
 	s->dead = true;
-	if (rate_limited(s))
-		timer_del(s->rate_limit_timer);
+	socket_unthrottle(s);
+	socket_handshake_done(s);
 	socket_unref(s);
 }
 
@@ -92,28 +193,62 @@ struct socket *socket_add(int fd, socket_cb_read_t cb_read, void *cb_data,
 			  cb_data_destructor_t cb_destructor)
 {
 	struct socket *s;
+	int type;
+	socklen_t type_len = sizeof(type);
 
-	s = salloc(sizeof(*s));
+	s = slab_alloc(&socket_pool);
 	s->refs = 1;
 	s->fd = fd;
-	s->rate_limit_timer = -1;
+	/* message boundaries matter on anything else */
+	s->stream = !getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) &&
+		    type == SOCK_STREAM;
+	s->rate_limited = false;
+	s->throttled_pprev = NULL;
+	s->peer = NULL;
+	s->rx_bytes = 0;
+	s->handshake_pprev = NULL;
 	s->dead = false;
+	s->paused = false;
 	s->should_close = true;
 	s->cb_read = cb_read;
 	s->cb_write_done = NULL;
 	s->cb_data = cb_data;
 	s->cb_destructor = cb_destructor;
+	s->reading_stopped = false;
+	s->backpressure = false;
 	s->wqueue = NULL;
-	s->wqueue_len = 0;
-	if (event_add_fd(fd, EV_SOCK | EV_READ, socket_cb, s, socket_kill) < 0) {
-		sfree(s);
+	s->wqueue_tail = &s->wqueue;
+	s->wqueue_bytes = 0;
+	s->in_buf = NULL;
+	s->in_size = s->in_start = s->in_len = 0;
+	s->in_max = s->stream ? IBUF_MAX : IBUF_PACKET;
+	s->in_peak = 0;
+	s->in_small = 0;
+	s->uring = s->stream && event_uring();
+	s->listener = false;
+	s->recv_state = RECV_NONE;
+	s->recv_op.cb = socket_recv_done;
+	s->in_new = 0;
+	s->sending = NULL;
+	s->kicked = false;
+	/* with io_uring, only for socket_kill to be called */
+	if (event_add_fd(fd, s->uring ? 0 : EV_SOCK | EV_READ, socket_cb, s,
+			 socket_kill) < 0) {
+		slab_free(&socket_pool, s);
 		return NULL;
 	}
+	if (s->uring)
+		socket_kick(s);
 	return s;
 }
 
 void socket_set_write_done_cb(struct socket *s, socket_cb_read_t cb_write_done)
 {
+	if (!s->wqueue) {
+		/* everything was already sent */
+		cb_write_done(s, s->cb_data);
+		return;
+	}
 	s->cb_write_done = cb_write_done;
 }
 
@@ -123,30 +258,195 @@ int socket_set_unmanaged(struct socket *s)
 	return s->fd;
 }
 
-static int socket_get_bucket(struct socket *s)
+/*** Rate limiting ***/
+
+/* the root of the bucket hierarchy */
+static struct ratelimit process_limit;
+
+/* Sockets waiting for tokens. They share a single timer armed for the
+ * earliest of them. */
+static struct socket *throttled;
+static int throttle_timer = -1;
+static struct timespec throttle_armed;
+static bool throttle_is_armed;
+
+static void ratelimit_init(struct ratelimit *rl, int rate, int size,
+			   struct ratelimit *parent)
 {
-	long t = time_elapsed(&s->last_xmit) * RATE / 1000;
-	if (t > BUCKET_SIZE)
-		t = BUCKET_SIZE;
-	if (t < 0)
-		/* should not happen */
-		t = 0;
-	return t;
+	rl->rate = rate;
+	rl->size = size;
+	rl->tokens = size;
+	rl->last_refill = *time_now();
+	rl->parent = parent;
 }
 
-static void socket_set_bucket(struct socket *s, int bucket)
+static void ratelimit_refill(struct ratelimit *rl)
 {
-	s->last_xmit = *time_now();
-	time_add(&s->last_xmit, -(bucket * 1000 / RATE));
+	long added = time_elapsed(&rl->last_refill) * rl->rate / 1000;
+
+	/* keep the remainder for the next time on slow rates */
+	if (added <= 0)
+		return;
+	rl->tokens += added;
+	if (rl->tokens > rl->size)
+		rl->tokens = rl->size;
+	rl->last_refill = *time_now();
 }
 
-void socket_set_ratelimit(struct socket *s)
+/* Returns the number of miliseconds to wait before a message of the given
+ * size can be sent, or zero if it can be sent now. In that case, the
+ * number of bytes that can be sent is stored to 'avail'. */
+static long ratelimit_check(struct ratelimit *rl, size_t size, long *avail)
 {
-	if (rate_limited(s))
+	long wait = 0;
+
+	*avail = LONG_MAX;
+	for (; rl; rl = rl->parent) {
+		long need;
+
+		if (!rl->rate)
+			continue;
+		ratelimit_refill(rl);
+		need = (long)size < rl->size ? (long)size : rl->size;
+		if (rl->tokens < need) {
+			long msec = ((need - rl->tokens) * 1000 + rl->rate - 1) /
+				    rl->rate;
+
+			if (msec > wait)
+				wait = msec;
+		}
+		if (rl->tokens < *avail)
+			*avail = rl->tokens;
+	}
+	return wait;
+}
+
+/* Whether any bucket of the hierarchy limits the rate. */
+static bool ratelimit_active(struct ratelimit *rl)
+{
+	for (; rl; rl = rl->parent)
+		if (rl->rate)
+			return true;
+	return false;
+}
+
+static void ratelimit_charge(struct ratelimit *rl, size_t size)
+{
+	for (; rl; rl = rl->parent)
+		if (rl->rate)
+			rl->tokens -= size;
+}
+
+void ratelimit_set(struct ratelimit *rl, int rate, int size)
+{
+	if (!rl->rate)
+		rl->tokens = size;
+	else
+		ratelimit_refill(rl);
+	rl->rate = rate;
+	rl->size = size;
+	if (rl->tokens > size)
+		rl->tokens = size;
+}
+
+struct ratelimit *ratelimit_new(int rate, int size)
+{
+	struct ratelimit *rl;
+
+	rl = salloc(sizeof(*rl));
+	ratelimit_init(rl, rate, size, &process_limit);
+	return rl;
+}
+
+void socket_set_process_ratelimit(int rate, int size)
+{
+	ratelimit_set(&process_limit, rate, size);
+}
+
+void socket_set_ratelimit(struct socket *s, int rate, int size,
+			  struct ratelimit *group)
+{
+	if (!group)
+		group = &process_limit;
+	if (s->rate_limited) {
+		ratelimit_set(&s->limit, rate, size);
+		s->limit.parent = group;
+		return;
+	}
+	ratelimit_init(&s->limit, rate, size, group);
+	s->rate_limited = true;
+}
+
+static void throttle_arm(void)
+{
+	struct socket *s;
+	struct timespec *first = NULL;
+
+	for (s = throttled; s; s = s->throttled_next)
+		if (!first || time_left(&s->throttled_until) < time_left(first))
+			first = &s->throttled_until;
+	if (!first) {
+		if (throttle_is_armed)
+			timer_disarm(throttle_timer);
+		throttle_is_armed = false;
+		return;
+	}
+	if (throttle_is_armed && throttle_armed.tv_sec == first->tv_sec &&
+	    throttle_armed.tv_nsec == first->tv_nsec)
 		return;
-	s->rate_limit_timer = timer_new(socket_ratelimit_cb, s, NULL);
-	socket_set_bucket(s, BUCKET_SIZE);
-	s->rate_limit_okay = false;
+	throttle_armed = *first;
+	throttle_is_armed = true;
+	timer_arm(throttle_timer, time_left(first) > 0 ? time_left(first) : 1,
+		  false);
+}
+
+static int throttle_cb(int fd __unused, int count __unused,
+		       void *data __unused)
+{
+	struct socket *s, *next;
+
+	throttle_is_armed = false;
+	for (s = throttled; s; s = next) {
+		next = s->throttled_next;
+		if (time_left(&s->throttled_until) > 0)
+			continue;
+		/* may throttle the socket again, it's added to the head */
+		socket_unthrottle(s);
+		if (s->uring)
+			socket_kick(s);
+		else if (s->paused)
+			event_change_fd_add(s->fd, EV_WRITE);
+		else
+			socket_process_wqueue(s);
+	}
+	throttle_arm();
+	return 0;
+}
+
+/* Waits for the given number of miliseconds before sending more. */
+static void socket_throttle(struct socket *s, long msec)
+{
+	if (throttle_timer < 0)
+		check(throttle_timer = timer_new(throttle_cb, NULL, NULL));
+	time_from_now(&s->throttled_until, msec);
+	if (!s->throttled_pprev) {
+		s->throttled_next = throttled;
+		if (throttled)
+			throttled->throttled_pprev = &s->throttled_next;
+		throttled = s;
+		s->throttled_pprev = &throttled;
+	}
+	throttle_arm();
+}
+
+static void socket_unthrottle(struct socket *s)
+{
+	if (!s->throttled_pprev)
+		return;
+	*s->throttled_pprev = s->throttled_next;
+	if (s->throttled_next)
+		s->throttled_next->throttled_pprev = s->throttled_pprev;
+	s->throttled_pprev = NULL;
 }
 
 int socket_get_fd(struct socket *s)
@@ -154,23 +454,69 @@ int socket_get_fd(struct socket *s)
 	return s->fd;
 }
 
+int socket_set_nodelay(struct socket *s)
+{
+	int one = 1;
+
+	if (!s->stream)
+		return 0;
+	if (setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+		/* not a TCP socket */
+		if (errno == EOPNOTSUPP || errno == ENOPROTOOPT)
+			return 0;
+		return -errno;
+	}
+	return 0;
+}
+
 int socket_stop_reading(struct socket *s)
 {
 	if (s->dead)
 		return 0;
+	s->reading_stopped = true;
+	if (s->uring) {
+		socket_kick(s);
+		return 0;
+	}
 	return event_change_fd_remove(s->fd, EV_READ);
 }
 
+/* Stops or resumes reading based on the write queue size. */
+static void socket_check_backpressure(struct socket *s)
+{
+	if (!s->backpressure && s->wqueue_bytes > WQUEUE_HIGH) {
+		s->backpressure = true;
+		if (!s->uring)
+			event_change_fd_remove(s->fd, EV_READ);
+	} else if (s->backpressure && s->wqueue_bytes <= WQUEUE_LOW) {
+		s->backpressure = false;
+		if (s->uring)
+			socket_kick(s);
+		else if (!s->reading_stopped)
+			event_change_fd_add(s->fd, EV_READ);
+	}
+}
+
 int socket_pause(struct socket *s, bool pause)
 {
 	if (s->dead)
 		return 0;
+	s->paused = pause;
+	if (s->uring) {
+		socket_kick(s);
+		return 0;
+	}
 	return event_pause_fd(s->fd, pause);
 }
 
 void socket_del(struct socket *s)
 {
+	if (s->dead)
+		return;
+	s->dead = true;
 	event_del_fd(s->fd);
+	if (s->uring)
+		socket_uring_del(s);
 }
 
 static void socket_del_cb(struct socket *s, void *data __unused)
@@ -186,6 +532,43 @@ void socket_flush_and_del(struct socket *s)
 		socket_set_write_done_cb(s, socket_del_cb);
 }
 
+static void ibuf_free(char *buf, size_t size)
+{
+	if (!buf)
+		return;
+	if (size == IBUF_MIN)
+		slab_free(&ibuf_pool, buf);
+	else
+		sfree(buf);
+}
+
+/* Moves the unconsumed data to a new buffer of the given size. */
+static void ibuf_resize(struct socket *s, size_t size)
+{
+	char *buf;
+
+	buf = size == IBUF_MIN ? slab_alloc(&ibuf_pool) : salloc(size);
+	if (s->in_len)
+		memcpy(buf, s->in_buf + s->in_start, s->in_len);
+	ibuf_free(s->in_buf, s->in_size);
+	s->in_buf = buf;
+	s->in_size = size;
+	s->in_start = 0;
+}
+
+static void ibuf_check_shrink(struct socket *s)
+{
+	if (!s->stream || s->in_size <= IBUF_MIN || s->in_len)
+		return;
+	if (s->in_peak > s->in_size / 4)
+		s->in_small = 0;
+	else if (++s->in_small >= IBUF_SHRINK) {
+		ibuf_resize(s, s->in_size / 2);
+		s->in_small = 0;
+	}
+	s->in_peak = 0;
+}
+
 void socket_ref(struct socket *s)
 {
 	s->refs++;
@@ -199,7 +582,10 @@ void socket_unref(struct socket *s)
 			s->cb_destructor(s->cb_data);
 		if (s->should_close)
 			close(s->fd);
-		sfree(s);
+		if (s->peer)
+			peer_release(s->peer);
+		ibuf_free(s->in_buf, s->in_size);
+		slab_free(&socket_pool, s);
 	}
 }
 
@@ -232,6 +618,7 @@ size_t socket_read_ancil(struct socket *s, void *buf, size_t size,
 		*ancil_size = 0;
 	} else {
 		*ancil_size = mh.msg_controllen;
+		s->rx_bytes += ret;
 	}
 	return ret;
 }
@@ -243,57 +630,215 @@ size_t socket_read(struct socket *s, void *buf, size_t size)
 	return socket_read_ancil(s, buf, size, NULL, &ancil_size);
 }
 
+size_t socket_fill_ancil(struct socket *s, void *ancil_buf,
+			 size_t *ancil_size)
+{
+	size_t ret;
+
+	if (s->uring) {
+		/* already in the buffer, see socket_recv_done */
+		ret = s->in_new;
+		s->in_new = 0;
+		*ancil_size = 0;
+		return ret;
+	}
+	if (!s->in_buf)
+		ibuf_resize(s, s->stream ? IBUF_MIN : s->in_max);
+	if (s->in_len > s->in_size / 2 && s->in_size < s->in_max) {
+		/* a large message in progress */
+		ibuf_resize(s, s->in_size * 2 < s->in_max ? s->in_size * 2 :
+							      s->in_max);
+	} else if (s->in_start + s->in_len == s->in_size) {
+		if (!s->in_start) {
+			log_warn("input buffer of socket %d is full", s->fd);
+			socket_del(s);
+			*ancil_size = 0;
+			return 0;
+		}
+		memmove(s->in_buf, s->in_buf + s->in_start, s->in_len);
+		s->in_start = 0;
+	}
+	ret = socket_read_ancil(s, s->in_buf + s->in_start + s->in_len,
+				s->in_size - s->in_start - s->in_len,
+				ancil_buf, ancil_size);
+	s->in_len += ret;
+	if (s->in_len > s->in_peak)
+		s->in_peak = s->in_len;
+	return ret;
+}
+
+size_t socket_fill(struct socket *s)
+{
+	size_t ancil_size = 0;
+
+	return socket_fill_ancil(s, NULL, &ancil_size);
+}
+
+void *socket_input(struct socket *s, size_t *len)
+{
+	*len = s->in_len;
+	return s->in_buf + s->in_start;
+}
+
+void socket_consume(struct socket *s, size_t len)
+{
+	s->in_start += len;
+	s->in_len -= len;
+	if (!s->in_len)
+		s->in_start = 0;
+}
+
+void socket_push_input(struct socket *s, void *buf, size_t len)
+{
+	size_t size = s->in_size ? s->in_size : IBUF_MIN;
+
+	if (!len)
+		return;
+	while (size < s->in_len + len)
+		size *= 2;
+	if (s->in_start + s->in_len + len > s->in_size)
+		ibuf_resize(s, size);
+	memcpy(s->in_buf + s->in_start + s->in_len, buf, len);
+	s->in_len += len;
+}
+
+void socket_set_input_max(struct socket *s, size_t size)
+{
+	s->in_max = size;
+}
+
+/* Closes the fds passed in the ancillary data. */
+static void close_ancil_fds(void *ancil_buf, size_t ancil_size)
+{
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	mh.msg_control = ancil_buf;
+	mh.msg_controllen = ancil_size;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		int *fds = (int *)CMSG_DATA(cmsg);
+		size_t cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (size_t i = 0; i < cnt; i++)
+			close(fds[i]);
+	}
+}
+
+static void free_ancil(void *ancil_buf, size_t ancil_size, bool close_fds)
+{
+	if (!ancil_buf)
+		return;
+	if (close_fds)
+		close_ancil_fds(ancil_buf, ancil_size);
+	sfree(ancil_buf);
+}
+
+struct sbuf *sbuf_new(size_t size)
+{
+	struct sbuf *b;
+
+	b = salloc(sizeof(*b) + size);
+	b->refs = 1;
+	b->size = size;
+	return b;
+}
+
+void *sbuf_data(struct sbuf *b)
+{
+	return b->data;
+}
+
+void sbuf_unref(struct sbuf *b)
+{
+	if (!--b->refs)
+		sfree(b);
+}
+
+static void msg_free(struct msg *m)
+{
+	free_ancil(m->ancil_buf, m->ancil_size, m->close_fds);
+	if (m->produce) {
+		if (m->produce_destructor)
+			m->produce_destructor(m->produce_data);
+	} else if (m->shared)
+		sbuf_unref(m->shared);
+	else if (m->buf != m->small)
+		sfree(m->buf);
+	slab_free(&msg_pool, m);
+}
+
 static void socket_queue_data(struct socket *s, void *buf, size_t size,
-			      void *ancil_buf, size_t ancil_size,
-			      int fd_to_close)
+			      bool copy, struct sbuf *shared, void *ancil_buf,
+			      size_t ancil_size, bool close_fds)
 {
-	struct msg *m, **ptr;
+	struct msg *m;
 
-	m = salloc(sizeof(*m));
-	m->buf = buf;
+	m = slab_alloc(&msg_pool);
+	if (copy) {
+		m->buf = size <= MSG_SMALL ? m->small : salloc(size);
+		memcpy(m->buf, buf, size);
+	} else {
+		m->buf = buf;
+	}
+	m->shared = shared;
 	m->size = size;
 	m->start = 0;
 	m->ancil_buf = ancil_buf;
 	m->ancil_size = ancil_size;
-	m->fd_to_close = fd_to_close;
+	m->close_fds = close_fds;
+	m->produce = NULL;
 	m->next = NULL;
 
-	for (ptr = &s->wqueue; *ptr; ptr = &(*ptr)->next)
-		;
-	*ptr = m;
+	*s->wqueue_tail = m;
+	s->wqueue_tail = &m->next;
+	s->wqueue_bytes += size;
+	socket_check_backpressure(s);
+}
 
-	s->wqueue_len++;
+/* Queues the message and sends it right away if nothing else is queued. */
+static int socket_send(struct socket *s, void *buf, size_t size, bool copy,
+		       struct sbuf *shared, void *ancil_buf, size_t ancil_size,
+		       bool close_fds)
+{
+	bool was_empty = !s->wqueue;
+
+	socket_queue_data(s, buf, size, copy, shared, ancil_buf, ancil_size,
+			  close_fds);
+	if (was_empty) {
+		if (s->uring) {
+			socket_kick(s);
+			return 0;
+		}
+		/* Try to send right away. EV_WRITE is requested only when
+		 * the socket buffer is full. */
+		if (s->paused)
+			return event_change_fd_add(s->fd, EV_WRITE);
+		socket_process_wqueue(s);
+	}
+	return 0;
 }
 
 int socket_write_ancil(struct socket *s, void *buf, size_t size, bool steal,
 		       void *ancil_buf, size_t ancil_size, bool ancil_steal,
-		       int fd_to_close)
+		       bool close_fds)
 {
-	int ret;
-	void *copied;
 	void *ancil_copied;
 
 	if (s->dead) {
 		if (steal)
 			sfree(buf);
 		if (ancil_steal)
-			sfree(ancil_buf);
+			free_ancil(ancil_buf, ancil_size, close_fds);
+		else if (close_fds)
+			close_ancil_fds(ancil_buf, ancil_size);
 		return 0;
 	}
 
-	if (s->wqueue_len >= WQUEUE_MAX_LEN)
+	if (s->wqueue_bytes > WQUEUE_MAX)
 		return -ENOBUFS;
 
-	ret = event_change_fd_add(s->fd, EV_WRITE);
-	if (ret < 0)
-		return ret;
-
-	if (steal)
-		copied = buf;
-	else {
-		copied = salloc(size);
-		memcpy(copied, buf, size);
-	}
 	if (!ancil_buf || ancil_steal) {
 		ancil_copied = ancil_buf;
 	} else {
@@ -301,78 +846,188 @@ int socket_write_ancil(struct socket *s, void *buf, size_t size, bool steal,
 		memcpy(ancil_copied, ancil_buf, ancil_size);
 	}
 
-	socket_queue_data(s, copied, size, ancil_copied, ancil_size, fd_to_close);
-	return 0;
+	return socket_send(s, buf, size, !steal, NULL, ancil_copied, ancil_size,
+			   close_fds);
 }
 
 int socket_write(struct socket *s, void *buf, size_t size, bool steal)
 {
-	return socket_write_ancil(s, buf, size, steal, NULL, 0, false, 0);
+	return socket_write_ancil(s, buf, size, steal, NULL, 0, false, false);
+}
+
+int socket_write_sbuf(struct socket *s, struct sbuf *b)
+{
+	if (s->dead)
+		return 0;
+	if (s->wqueue_bytes > WQUEUE_MAX)
+		return -ENOBUFS;
+	b->refs++;
+	return socket_send(s, b->data, b->size, false, b, NULL, 0, false);
+}
+
+int socket_write_producer(struct socket *s, socket_produce_t produce,
+			  void *data, cb_data_destructor_t destructor,
+			  size_t held)
+{
+	struct msg *m;
+	bool was_empty = !s->wqueue;
+
+	if (s->dead) {
+		if (destructor)
+			destructor(data);
+		return 0;
+	}
+
+	m = slab_alloc(&msg_pool);
+	m->buf = NULL;
+	m->shared = NULL;
+	m->size = held;
+	m->start = 0;
+	m->ancil_buf = NULL;
+	m->ancil_size = 0;
+	m->close_fds = false;
+	m->produce = produce;
+	m->produce_data = data;
+	m->produce_destructor = destructor;
+	m->next = NULL;
+
+	*s->wqueue_tail = m;
+	s->wqueue_tail = &m->next;
+	s->wqueue_bytes += held;
+	socket_check_backpressure(s);
+	if (was_empty) {
+		if (s->uring) {
+			socket_kick(s);
+			return 0;
+		}
+		if (s->paused)
+			return event_change_fd_add(s->fd, EV_WRITE);
+		socket_process_wqueue(s);
+	}
+	return 0;
+}
+
+static void socket_pop_wqueue(struct socket *s)
+{
+	struct msg *m = s->wqueue;
+
+	s->wqueue = m->next;
+	if (!s->wqueue)
+		s->wqueue_tail = &s->wqueue;
+	s->wqueue_bytes -= m->size;
+	socket_check_backpressure(s);
+	msg_free(m);
+}
+
+/* Puts the next chunk of the producer message "*pp" in front of it. The
+ * last chunk replaces the producer. */
+static void socket_produce(struct socket *s, struct msg **pp)
+{
+	struct msg *p = *pp, *m;
+	void *buf;
+	size_t size, chunk;
+	bool done = false;
+
+	if (s->rate_limited && ratelimit_active(&s->limit))
+		chunk = PRODUCE_CHUNK;
+	else
+		chunk = PRODUCE_CHUNK_FAST;
+	buf = salloc(chunk);
+	size = p->produce(buf, chunk, &done, p->produce_data);
+	if (done) {
+		if (p->produce_destructor)
+			p->produce_destructor(p->produce_data);
+		p->produce = NULL;
+		p->buf = buf;
+		s->wqueue_bytes = s->wqueue_bytes - p->size + size;
+		p->size = size;
+		socket_check_backpressure(s);
+		return;
+	}
+
+	m = slab_alloc(&msg_pool);
+	m->buf = buf;
+	m->shared = NULL;
+	m->size = size;
+	m->start = 0;
+	m->ancil_buf = NULL;
+	m->ancil_size = 0;
+	m->close_fds = false;
+	m->produce = NULL;
+	m->next = p;
+	*pp = m;
+	s->wqueue_bytes += size;
+	socket_check_backpressure(s);
 }
 
 static void socket_process_wqueue(struct socket *s)
 {
+	static struct iovec iov[IOV_MAX];
+
 	while (s->wqueue) {
 		struct msg *m = s->wqueue;
 		struct msghdr mh;
-		struct iovec iov;
+		size_t limit = SIZE_MAX, total = 0;
 		ssize_t written;
-		int bucket = 0;
+		int cnt = 0, flags;
+
+		if (m->produce) {
+			socket_produce(s, &s->wqueue);
+			continue;
+		}
 
-		if (rate_limited(s) && !s->rate_limit_okay) {
-			bucket = socket_get_bucket(s);
-			if (m->size > (unsigned)bucket) {
-				long msec;
+		if (s->rate_limited) {
+			long avail, wait;
 
-				msec = (m->size - bucket) * 1000 / RATE;
-				if (msec <= 0)
-					msec = 1;
+			if (s->throttled_pprev)
+				return;
+			wait = ratelimit_check(&s->limit, m->size, &avail);
+			if (wait) {
 				event_change_fd_remove(s->fd, EV_WRITE);
-				timer_arm(s->rate_limit_timer, msec, false);
+				socket_throttle(s, wait);
 				return;
 			}
-			bucket -= m->size;
+			/* a message larger than the bucket goes alone */
+			limit = avail > (long)m->size ? (size_t)avail : m->size;
 		}
 
-		iov.iov_base = m->buf + m->start;
-		iov.iov_len = m->size;
+		/* On stream sockets, gather the following messages up to
+		 * the next one with ancillary data, which has to start its
+		 * own sendmsg. A producer is expanded only once it gets to
+		 * the head. */
+		for (; m && cnt < IOV_MAX; m = m->next) {
+			if (m->produce)
+				break;
+			if (cnt && (!s->stream || m->ancil_buf ||
+				    total + m->size > limit))
+				break;
+			iov[cnt].iov_base = m->buf + m->start;
+			iov[cnt].iov_len = m->size;
+			total += m->size;
+			cnt++;
+		}
+		/* more data follow from the producer right away, let the
+		 * kernel send full segments only */
+		flags = MSG_NOSIGNAL;
+		if (m && m->produce && s->stream)
+			flags |= MSG_MORE;
+		m = s->wqueue;
 
 		mh.msg_name = NULL;
 		mh.msg_namelen = 0;
-		mh.msg_iov = &iov;
-		mh.msg_iovlen = 1;
+		mh.msg_iov = iov;
+		mh.msg_iovlen = cnt;
 		mh.msg_control = m->ancil_buf;
 		mh.msg_controllen = m->ancil_size;
 		mh.msg_flags = 0;
 
-		written = sendmsg(s->fd, &mh, 0);
-		if (written < 0 && (errno == EAGAIN || errno == EINTR))
+		written = sendmsg(s->fd, &mh, flags);
+		if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
+			event_change_fd_add(s->fd, EV_WRITE);
 			return;
-		if (written != 0) {
-			if (m->ancil_buf) {
-				sfree(m->ancil_buf);
-				m->ancil_buf = NULL;
-				m->ancil_size = 0;
-			}
-			if (m->fd_to_close) {
-				close(m->fd_to_close);
-				m->fd_to_close = 0;
-			}
 		}
-		if (written < 0 || (size_t)written == m->size) {
-			s->wqueue = m->next;
-			s->wqueue_len--;
-			sfree(m->buf);
-			sfree(m);
-			if (rate_limited(s)) {
-				s->rate_limit_okay = false;
-				socket_set_bucket(s, bucket);
-			}
-		} else {
-			m->size -= written;
-			m->start += written;
-			if (rate_limited(s) && !s->rate_limit_okay)
-				socket_set_bucket(s, bucket + m->size);
+		if (!socket_sent(s, written, cnt)) {
+			event_change_fd_add(s->fd, EV_WRITE);
 			return;
 		}
 	}
@@ -385,77 +1040,392 @@ static void socket_process_wqueue(struct socket *s)
 	}
 }
 
+/* Removes the data written by a sendmsg of the first "cnt" queued
+ * messages; a failed sendmsg drops the first one. Returns false if a
+ * message was written only partially. */
+static bool socket_sent(struct socket *s, ssize_t written, int cnt)
+{
+	struct msg *m = s->wqueue;
+
+	if (written < 0) {
+		/* drop the message */
+		written = m->size;
+		cnt = 1;
+	}
+	if (written != 0) {
+		free_ancil(m->ancil_buf, m->ancil_size, m->close_fds);
+		m->ancil_buf = NULL;
+		m->ancil_size = 0;
+	}
+	if (s->rate_limited)
+		ratelimit_charge(&s->limit, written);
+	for (size_t left = written; cnt--; ) {
+		m = s->wqueue;
+		if (left < m->size) {
+			m->size -= left;
+			m->start += left;
+			s->wqueue_bytes -= left;
+			socket_check_backpressure(s);
+			return false;
+		}
+		left -= m->size;
+		socket_pop_wqueue(s);
+	}
+	return true;
+}
+
 static void socket_del_wqueue(struct socket *s)
 {
 	while (s->wqueue) {
 		struct msg *m = s->wqueue;
 
 		s->wqueue = m->next;
-		if (m->ancil_buf)
-			sfree(m->ancil_buf);
-		if (m->fd_to_close)
-			close(m->fd_to_close);
-		sfree(m->buf);
-		sfree(m);
+		msg_free(m);
+	}
+	s->wqueue_tail = &s->wqueue;
+	s->wqueue_bytes = 0;
+}
+
+/*** Per address limits ***/
+
+/* Limits of the connections from a single address, checked right after
+ * accept. */
+#define PEER_CONN_MAX		64	/* concurrent connections */
+#define PEER_ACCEPT_RATE	20	/* connections per second */
+#define PEER_ACCEPT_BURST	60
+
+#define PEER_HASH_SIZE		256
+
+struct peer {
+	/* IPv4 addresses are stored IPv4-mapped */
+	struct in6_addr addr;
+	int conns;
+	struct ratelimit accepts;
+	bool warned;
+	struct peer *next;
+};
+
+SLAB_POOL(peer_pool, struct peer);
+
+static struct peer *peers[PEER_HASH_SIZE];
+static bool listening;
+static unsigned long peers_cnt;
+static unsigned long rejected_conns;
+static unsigned long rejected_rate;
+
+/* Stores the normalized address. Returns false for non-IP addresses. */
+static bool peer_addr(struct sockaddr_storage *ss, struct in6_addr *res)
+{
+	if (ss->ss_family == AF_INET6) {
+		*res = ((struct sockaddr_in6 *)ss)->sin6_addr;
+		return true;
+	}
+	if (ss->ss_family == AF_INET) {
+		memset(res, 0, sizeof(*res));
+		res->s6_addr[10] = res->s6_addr[11] = 0xff;
+		memcpy(res->s6_addr + 12, &((struct sockaddr_in *)ss)->sin_addr, 4);
+		return true;
+	}
+	return false;
+}
+
+static const char *format_addr(struct in6_addr *addr, char *buf, size_t size)
+{
+	if (IN6_IS_ADDR_V4MAPPED(addr))
+		return inet_ntop(AF_INET, addr->s6_addr + 12, buf, size);
+	return inet_ntop(AF_INET6, addr, buf, size);
+}
+
+static unsigned peer_hash(struct in6_addr *addr)
+{
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; i < 16; i++)
+		h = (h ^ addr->s6_addr[i]) * 16777619u;
+	return h % PEER_HASH_SIZE;
+}
+
+/* An entry without connections is dropped once its accept bucket is full,
+ * i.e. when it would be recreated in the same state. */
+static bool peer_unused(struct peer *p)
+{
+	if (p->conns)
+		return false;
+	ratelimit_refill(&p->accepts);
+	return p->accepts.tokens >= p->accepts.size;
+}
+
+/* Finds or creates the entry for the address. Prunes unused entries on
+ * the way. */
+static struct peer *peer_get(struct in6_addr *addr)
+{
+	struct peer **pp = &peers[peer_hash(addr)];
+	struct peer *p;
+
+	while ((p = *pp)) {
+		if (!memcmp(&p->addr, addr, sizeof(*addr)))
+			return p;
+		if (peer_unused(p)) {
+			*pp = p->next;
+			slab_free(&peer_pool, p);
+			peers_cnt--;
+			continue;
+		}
+		pp = &p->next;
 	}
-	s->wqueue_len = 0;
+
+	p = slab_alloc(&peer_pool);
+	p->addr = *addr;
+	p->conns = 0;
+	ratelimit_init(&p->accepts, PEER_ACCEPT_RATE, PEER_ACCEPT_BURST, NULL);
+	p->warned = false;
+	p->next = NULL;
+	*pp = p;
+	peers_cnt++;
+	return p;
 }
 
+static void peer_release(struct peer *p)
+{
+	struct peer **pp;
+
+	p->conns--;
+	if (!peer_unused(p))
+		return;
+	for (pp = &peers[peer_hash(&p->addr)]; *pp != p; pp = &(*pp)->next)
+		;
+	*pp = p->next;
+	slab_free(&peer_pool, p);
+	peers_cnt--;
+}
+
+/* Checks the limits for a new connection from the address. */
+static bool peer_admit(struct peer *p)
+{
+	long avail;
+	const char *why;
+	char buf[INET6_ADDRSTRLEN];
+
+	if (p->conns >= PEER_CONN_MAX) {
+		rejected_conns++;
+		why = "too many connections";
+	} else if (ratelimit_check(&p->accepts, 1, &avail)) {
+		rejected_rate++;
+		why = "connecting too fast";
+	} else {
+		ratelimit_charge(&p->accepts, 1);
+		return true;
+	}
+	/* once per episode, the log would be flooded otherwise */
+	if (!p->warned)
+		log_warn("rejecting connections from %s: %s",
+			 format_addr(&p->addr, buf, sizeof(buf)), why);
+	p->warned = true;
+	return false;
+}
+
+/*** Handshake deadlines ***/
+
+/* the average rate is not checked during this initial time */
+#define PROGRESS_GRACE		5000
+#define REAP_INTERVAL		1000
+
+/* Sockets in handshake. They are checked by a single periodic timer. */
+static struct socket *handshaking;
+static int reap_timer = -1;
+static unsigned long reaped_deadline;
+static unsigned long reaped_slow;
+
+static int reap_cb(int fd __unused, int count __unused, void *data __unused)
+{
+	struct socket *s;
+
+	for (s = handshaking; s; s = s->handshake_next) {
+		long elapsed;
+
+		if (s->dead)
+			/* unlinked by socket_kill */
+			continue;
+		elapsed = time_elapsed(&s->accepted);
+		if (elapsed >= s->handshake_msec) {
+			log_info("socket %d: no handshake in %ld ms, closing",
+				 s->fd, elapsed);
+			reaped_deadline++;
+			socket_del(s);
+		} else if (elapsed >= PROGRESS_GRACE &&
+			   s->rx_bytes * 1000 / elapsed <
+			   (size_t)s->handshake_min_rate) {
+			log_info("socket %d: %zu bytes in %ld ms, too slow, "
+				 "closing", s->fd, s->rx_bytes, elapsed);
+			reaped_slow++;
+			socket_del(s);
+		}
+	}
+	return 0;
+}
+
+void socket_set_handshake_deadline(struct socket *s, int msec, int min_rate)
+{
+	if (reap_timer < 0)
+		check(reap_timer = timer_new(reap_cb, NULL, NULL));
+	if (!handshaking)
+		timer_arm(reap_timer, REAP_INTERVAL, true);
+	s->accepted = *time_now();
+	s->handshake_msec = msec;
+	s->handshake_min_rate = min_rate;
+	if (s->handshake_pprev)
+		return;
+	s->handshake_next = handshaking;
+	if (handshaking)
+		handshaking->handshake_pprev = &s->handshake_next;
+	handshaking = s;
+	s->handshake_pprev = &handshaking;
+}
+
+static void socket_handshake_done(struct socket *s)
+{
+	if (!s->handshake_pprev)
+		return;
+	*s->handshake_pprev = s->handshake_next;
+	if (s->handshake_next)
+		s->handshake_next->handshake_pprev = s->handshake_pprev;
+	s->handshake_pprev = NULL;
+	if (!handshaking)
+		timer_disarm(reap_timer);
+}
+
+void socket_log_stats(void)
+{
+	if (!listening)
+		return;
+	log_info("peers: %lu addresses tracked, rejected %lu connections over "
+		 "the limit and %lu over the accept rate", peers_cnt,
+		 rejected_conns, rejected_rate);
+	log_info("handshakes: %lu sockets reaped after the deadline, %lu for "
+		 "being too slow", reaped_deadline, reaped_slow);
+}
+
+/*** Listening ***/
+
 struct listen_data {
 	unsigned port;
+	/* Unix socket path, NULL for TCP */
+	char *path;
 	socket_cb_new_t cb_new;
 	socket_cb_read_t cb_read;
 	cb_data_destructor_t cb_destructor;
 };
 
+/* Sets up an accepted connection. Returns false if it cannot be added. */
+static bool socket_accepted(struct listen_data *ldata, int fd,
+			    struct sockaddr_storage *ss)
+{
+	struct in6_addr addr;
+	struct peer *peer = NULL;
+	char buf[INET6_ADDRSTRLEN];
+	struct socket *conn_s;
+
+	if (peer_addr(ss, &addr)) {
+		peer = peer_get(&addr);
+		if (!peer_admit(peer)) {
+			close(fd);
+			return true;
+		}
+		peer->warned = false;
+		log_info("accepting connection on port %u from %s with fd %d",
+			 ldata->port, format_addr(&addr, buf, sizeof(buf)), fd);
+	} else {
+		log_info("accepting connection on %s with fd %d", ldata->path,
+			 fd);
+	}
+	conn_s = socket_add(fd, ldata->cb_read, NULL, ldata->cb_destructor);
+	if (!conn_s) {
+		close(fd);
+		return false;
+	}
+	if (peer) {
+		conn_s->peer = peer;
+		peer->conns++;
+	}
+	if (ldata->cb_new)
+		conn_s->cb_data = ldata->cb_new(conn_s);
+	return true;
+}
+
 static void socket_accept(struct socket *s, void *data)
 {
-	struct listen_data *ldata = data;
-	struct sockaddr_in6 sin6;
-	socklen_t sin6_len;
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
 	int fd;
-	char buf[320];
-	struct socket *conn_s;
 
-	while (true) {
-		sin6_len = sizeof(sin6);
-		fd = accept4(s->fd, (struct sockaddr *)&sin6, &sin6_len,
+	do {
+		ss_len = sizeof(ss);
+		fd = accept4(s->fd, (struct sockaddr *)&ss, &ss_len,
 			     SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (fd < 0)
 			return;
-		// FIXME: convert IPv4-mapped IPv6 address into IPv4 format
-		log_info("accepting connection on port %u from %s with fd %d", ldata->port,
-			inet_ntop(sin6.sin6_family, &sin6.sin6_addr, buf, sizeof(buf)), fd);
-		conn_s = socket_add(fd, ldata->cb_read, NULL, ldata->cb_destructor);
-		if (!conn_s) {
-			close(fd);
-			return;
-		}
-		if (ldata->cb_new)
-			conn_s->cb_data = ldata->cb_new(conn_s);
-	}
+	} while (socket_accepted(data, fd, &ss));
 }
 
-int socket_listen(unsigned port, socket_cb_new_t cb_new,
-		  socket_cb_read_t cb_read,
-		  cb_data_destructor_t cb_destructor)
+static bool reuse_port = false;
+
+void socket_set_reuse_port(bool reuse)
+{
+	reuse_port = reuse;
+}
+
+static void listen_data_free(void *data)
+{
+	struct listen_data *ldata = data;
+
+	sfree(ldata->path);
+	sfree(ldata);
+}
+
+/* Starts listening on the bound socket. Closes the fd on error. */
+static int listen_fd(int fd, unsigned port, const char *path,
+		     socket_cb_new_t cb_new, socket_cb_read_t cb_read,
+		     cb_data_destructor_t cb_destructor)
 {
 	struct listen_data *ldata;
-	int fd;
-	struct sockaddr_in6 sin6;
-	int tmp;
+	struct socket *s;
+
+	if (listen(fd, 128) < 0) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
 
 	ldata = salloc(sizeof(*ldata));
 	ldata->port = port;
+	ldata->path = path ? sstrdup(path) : NULL;
 	ldata->cb_new = cb_new;
 	ldata->cb_read = cb_read;
 	ldata->cb_destructor = cb_destructor;
+	s = socket_add(fd, socket_accept, ldata, listen_data_free);
+	if (!s) {
+		listen_data_free(ldata);
+		close(fd);
+		return -EBADF;
+	}
+	/* accepts by completions with io_uring, see socket_sync_input */
+	s->listener = true;
+	listening = true;
+	return 0;
+}
+
+int socket_listen(unsigned port, socket_cb_new_t cb_new,
+		  socket_cb_read_t cb_read,
+		  cb_data_destructor_t cb_destructor)
+{
+	int fd;
+	struct sockaddr_in6 sin6;
+	int tmp;
 
 	fd = socket(AF_INET6, SOCK_STREAM, 0);
-	if (fd < 0) {
-		sfree(ldata);
+	if (fd < 0)
 		return -errno;
-	}
 	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
 		goto error;
 	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
@@ -466,6 +1436,9 @@ int socket_listen(unsigned port, socket_cb_new_t cb_new,
 	tmp = 1;
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(tmp)) < 0)
 		goto error;
+	if (reuse_port &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof(tmp)) < 0)
+		goto error;
 
 	memset(&sin6, 0, sizeof(sin6));
 	sin6.sin6_family = AF_INET6;
@@ -473,20 +1446,422 @@ int socket_listen(unsigned port, socket_cb_new_t cb_new,
 	if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)
 		goto error;
 
-	if (listen(fd, 128) < 0)
-		goto error;
-
-	if (!socket_add(fd, socket_accept, ldata, free)) {
-		errno = -EBADF;
-		goto error;
-	}
-
-	return 0;
+	return listen_fd(fd, port, NULL, cb_new, cb_read, cb_destructor);
 
 error: ;
 	int ret = errno;
 
 	close(fd);
-	sfree(ldata);
 	return -ret;
 }
+
+int socket_listen_unix(const char *path, socket_cb_new_t cb_new,
+		       socket_cb_read_t cb_read,
+		       cb_data_destructor_t cb_destructor)
+{
+	struct sockaddr_un sun;
+	socklen_t sun_len;
+	size_t len = strlen(path);
+	bool abstract = path[0] == '@';
+	struct stat st;
+	int fd;
+
+	if (!len)
+		return -EINVAL;
+	if (len >= sizeof(sun.sun_path))
+		return -ENAMETOOLONG;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len);
+	/* the abstract name is not NUL terminated */
+	sun_len = offsetof(struct sockaddr_un, sun_path) + len + !abstract;
+	if (abstract)
+		sun.sun_path[0] = '\0';
+	else if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		/* left behind by a previous run */
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (bind(fd, (struct sockaddr *)&sun, sun_len) < 0) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+	return listen_fd(fd, 0, path, cb_new, cb_read, cb_destructor);
+}
+
+/*** Completion based I/O ***/
+
+/* With the io_uring backend, stream sockets are not polled. While the
+ * socket is read, a one shot receive into a provided buffer is armed; the
+ * data are appended to the input buffer and cb_read is called, for which
+ * socket_fill returns them. When reading is paused, stopped or held back
+ * by a full write queue, a poll request for the peer closing the
+ * connection is armed instead, as epoll still reports that. Received data
+ * wait in the input buffer until reading resumes. A receive armed at
+ * socket_stop_reading is cancelled: the socket may be passed to another
+ * process.
+ *
+ * The write queue is sent by a chain of linked sendmsg requests, each of
+ * them covering what socket_process_wqueue would pass to one sendmsg;
+ * producers are expanded ahead, a chunk per request. The chains are
+ * submitted once per loop iteration, see socket_kick. Listening sockets
+ * accept by a multishot request.
+ *
+ * Each request in flight holds a reference to the socket. */
+
+#define SEND_LINKS	4
+#define SEND_IOVS	256
+
+struct send_chain {
+	/* shared by all the requests, they complete in order */
+	struct event_op op;
+	struct socket *s;
+	int links, done;
+	int cnt[SEND_LINKS];
+	struct msghdr mh[SEND_LINKS];
+	struct iovec iov[SEND_IOVS];
+};
+
+SLAB_POOL(send_pool, struct send_chain);
+
+static struct socket *kicked;
+static struct socket **kicked_tail = &kicked;
+static bool kick_scheduled;
+
+static bool socket_reading(struct socket *s)
+{
+	return !s->paused && !s->reading_stopped && !s->backpressure;
+}
+
+static void socket_arm(struct socket *s, int state)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = event_op_sqe(&s->recv_op);
+	if (!sqe) {
+		socket_del(s);
+		return;
+	}
+	sqe->fd = s->fd;
+	if (state == RECV_DATA) {
+		size_t room = s->in_max > s->in_len ? s->in_max - s->in_len : 0;
+
+		sqe->opcode = IORING_OP_RECV;
+		/* one byte more than fits gets the socket closed, as with
+		 * socket_fill */
+		sqe->len = room ? room : 1;
+		event_buf_select(sqe);
+	} else if (state == RECV_POLL) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = EV_ERROR;
+	} else {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	s->recv_state = state;
+	s->recv_cancelled = false;
+	socket_ref(s);
+}
+
+static void socket_cancel_recv(struct socket *s)
+{
+	if (s->recv_state == RECV_NONE || s->recv_cancelled)
+		return;
+	event_op_cancel(&s->recv_op);
+	s->recv_cancelled = true;
+}
+
+/* Passes the data received while the socket was not read to cb_read and
+ * arms the request the socket needs. */
+static void socket_sync_input(struct socket *s)
+{
+	bool reading = socket_reading(s);
+
+	if (s->listener) {
+		if (s->recv_state == RECV_NONE)
+			socket_arm(s, RECV_ACCEPT);
+		return;
+	}
+	if (reading && s->in_new) {
+		s->cb_read(s, s->cb_data);
+		ibuf_check_shrink(s);
+		if (s->dead)
+			return;
+		reading = socket_reading(s);
+	}
+	if (s->recv_state == RECV_NONE)
+		socket_arm(s, reading ? RECV_DATA : RECV_POLL);
+	else if (s->recv_state == RECV_DATA && s->reading_stopped)
+		socket_cancel_recv(s);
+	else if (s->recv_state == RECV_POLL && reading)
+		socket_cancel_recv(s);
+}
+
+/* Appends the received data to the input buffer. */
+static void ibuf_append(struct socket *s, void *buf, size_t len)
+{
+	size_t size;
+
+	if (!s->in_buf)
+		ibuf_resize(s, IBUF_MIN);
+	if (s->in_len + len > s->in_max) {
+		log_warn("input buffer of socket %d is full", s->fd);
+		socket_del(s);
+		return;
+	}
+	if (s->in_start + s->in_len + len > s->in_size) {
+		for (size = s->in_size; size < s->in_len + len; size *= 2)
+			;
+		if (size > s->in_max)
+			size = s->in_max;
+		if (size > s->in_size) {
+			ibuf_resize(s, size);
+		} else {
+			memmove(s->in_buf, s->in_buf + s->in_start, s->in_len);
+			s->in_start = 0;
+		}
+	}
+	memcpy(s->in_buf + s->in_start + s->in_len, buf, len);
+	s->in_len += len;
+	s->in_new += len;
+	s->rx_bytes += len;
+	if (s->in_len > s->in_peak)
+		s->in_peak = s->in_len;
+}
+
+static void socket_accept_done(struct socket *s, int res, unsigned flags)
+{
+	struct sockaddr_storage ss;
+	socklen_t ss_len = sizeof(ss);
+
+	if (!(flags & IORING_CQE_F_MORE))
+		s->recv_state = RECV_NONE;
+	if (res >= 0 && s->dead) {
+		close(res);
+	} else if (res >= 0) {
+		/* not returned by multishot accept */
+		if (getpeername(res, (struct sockaddr *)&ss, &ss_len) < 0)
+			ss.ss_family = AF_UNSPEC;
+		socket_accepted(s->cb_data, res, &ss);
+	}
+	if (s->recv_state != RECV_NONE)
+		return;
+	if (!s->dead)
+		socket_sync_input(s);
+	socket_unref(s);
+}
+
+static void socket_recv_done(struct event_op *op, int res, unsigned flags)
+{
+	struct socket *s = container_of(op, struct socket, recv_op);
+	int state = s->recv_state;
+
+	if (state == RECV_ACCEPT) {
+		socket_accept_done(s, res, flags);
+		return;
+	}
+	s->recv_state = RECV_NONE;
+	if (flags & IORING_CQE_F_BUFFER) {
+		if (res > 0 && !s->dead)
+			ibuf_append(s, event_buf_get(flags), res);
+		event_buf_put(flags);
+	}
+	if (s->dead)
+		goto out;
+	if (res == -ECANCELED || res == -ENOBUFS)
+		/* re-armed below */
+		;
+	else if (state == RECV_DATA ? res <= 0 : (res < 0 || (res & EV_ERROR))) {
+		log_info("socket %d was closed by the other side", s->fd);
+		socket_del(s);
+		goto out;
+	}
+	socket_sync_input(s);
+out:
+	socket_unref(s);
+}
+
+static void socket_send_done(struct event_op *op, int res,
+			     unsigned flags __unused)
+{
+	struct send_chain *c = container_of(op, struct send_chain, op);
+	struct socket *s = c->s;
+	int cnt = c->cnt[c->done++];
+
+	/* the requests following a partial write are cancelled, their
+	 * messages are sent again */
+	if (res != -ECANCELED && !s->dead)
+		socket_sent(s, res, cnt);
+	if (c->done < c->links)
+		return;
+	s->sending = NULL;
+	slab_free(&send_pool, c);
+	socket_kick(s);
+	socket_unref(s);
+}
+
+/* Submits the queued messages as a chain of linked requests. */
+static void socket_send_chain(struct socket *s, int flags)
+{
+	struct send_chain *c;
+	struct msg **pp = &s->wqueue, *m;
+	size_t limit = SIZE_MAX, total = 0;
+	int iovs = 0;
+
+	if (s->wqueue->produce)
+		socket_produce(s, &s->wqueue);
+	if (s->rate_limited) {
+		long avail, wait;
+
+		if (s->throttled_pprev)
+			return;
+		wait = ratelimit_check(&s->limit, s->wqueue->size, &avail);
+		if (wait) {
+			socket_throttle(s, wait);
+			return;
+		}
+		/* a message larger than the bucket goes alone */
+		limit = avail > (long)s->wqueue->size ? (size_t)avail :
+							 s->wqueue->size;
+	}
+
+	c = slab_alloc(&send_pool);
+	c->op.cb = socket_send_done;
+	c->s = s;
+	c->links = 0;
+	c->done = 0;
+	m = *pp;
+	while (m && c->links < SEND_LINKS && iovs < SEND_IOVS) {
+		struct msghdr *mh = &c->mh[c->links];
+		int cnt = 0;
+
+		/* a request per chunk of a producer */
+		if (m->produce) {
+			socket_produce(s, pp);
+			m = *pp;
+		}
+		mh->msg_name = NULL;
+		mh->msg_namelen = 0;
+		mh->msg_iov = &c->iov[iovs];
+		mh->msg_control = m->ancil_buf;
+		mh->msg_controllen = m->ancil_size;
+		mh->msg_flags = 0;
+		for (; m && iovs < SEND_IOVS; pp = &m->next, m = *pp) {
+			if (m->produce || (cnt && m->ancil_buf))
+				break;
+			if (total && total + m->size > limit)
+				break;
+			c->iov[iovs].iov_base = m->buf + m->start;
+			c->iov[iovs].iov_len = m->size;
+			total += m->size;
+			iovs++;
+			cnt++;
+		}
+		if (!cnt)
+			break;
+		mh->msg_iovlen = cnt;
+		c->cnt[c->links++] = cnt;
+		if (m && !m->produce)
+			/* stopped by the rate limit or the ancillary data */
+			break;
+	}
+
+	if (!c->links || event_reserve(c->links) < 0) {
+		slab_free(&send_pool, c);
+		return;
+	}
+	for (int i = 0; i < c->links; i++) {
+		struct io_uring_sqe *sqe = event_op_sqe(&c->op);
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = s->fd;
+		sqe->addr = (uintptr_t)&c->mh[i];
+		/* retried until all is written, a short write would break
+		 * the chain */
+		sqe->msg_flags = MSG_NOSIGNAL | flags;
+		if (!(flags & MSG_DONTWAIT)) {
+			sqe->msg_flags |= MSG_WAITALL;
+			if (i < c->links - 1 || (m && m->produce))
+				sqe->msg_flags |= MSG_MORE;
+		}
+		if (i < c->links - 1)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+	s->sending = c;
+	socket_ref(s);
+}
+
+static void socket_sync_output(struct socket *s)
+{
+	if (s->sending)
+		return;
+	if (s->wqueue && !s->paused) {
+		socket_send_chain(s, 0);
+		return;
+	}
+	if (!s->wqueue && s->cb_write_done) {
+		s->cb_write_done(s, s->cb_data);
+		s->cb_write_done = NULL;
+	}
+}
+
+static void socket_flush(void *data __unused)
+{
+	struct socket *s;
+
+	while ((s = kicked)) {
+		kicked = s->kick_next;
+		if (!kicked)
+			kicked_tail = &kicked;
+		s->kicked = false;
+		if (!s->dead)
+			socket_sync_input(s);
+		if (!s->dead)
+			socket_sync_output(s);
+		socket_unref(s);
+	}
+	kick_scheduled = false;
+}
+
+/* Schedules the socket's requests to be brought up to date before the
+ * loop waits for new events. Writes done by the callbacks of a single
+ * iteration are thus sent together. */
+static void socket_kick(struct socket *s)
+{
+	if (s->kicked || s->dead)
+		return;
+	s->kicked = true;
+	socket_ref(s);
+	s->kick_next = NULL;
+	*kicked_tail = s;
+	kicked_tail = &s->kick_next;
+	if (kick_scheduled)
+		return;
+	if (event_defer(socket_flush, NULL) < 0) {
+		socket_flush(NULL);
+		return;
+	}
+	kick_scheduled = true;
+}
+
+static void socket_uring_del(struct socket *s)
+{
+	socket_cancel_recv(s);
+	if (s->sending) {
+		event_op_cancel(&s->sending->op);
+		return;
+	}
+	if (!s->wqueue || s->paused)
+		return;
+	/* What a direct sendmsg would have written before the socket was
+	 * deleted. It's submitted right away, as the fd may be passed to
+	 * another process and closed. */
+	socket_send_chain(s, MSG_DONTWAIT);
+	if (s->sending)
+		event_submit();
+}
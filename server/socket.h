@@ -5,6 +5,13 @@
 
 struct socket;
 
+/* An immutable reference counted buffer. It can be queued to several
+ * sockets without copying. */
+struct sbuf;
+
+/* A token bucket shared by a group of sockets. */
+struct ratelimit;
+
 typedef void (*socket_cb_read_t)(struct socket *s, void *data);
 /* Returns cb_data. */
 typedef void *(*socket_cb_new_t)(struct socket *s);
@@ -25,10 +32,26 @@ void socket_set_write_done_cb(struct socket *s, socket_cb_read_t cb_write_done);
  * Returns the file descriptor. */
 int socket_set_unmanaged(struct socket *s);
 
-/* Sets the socket as rate limited. The rate limit is fixed, applies per
- * socket and cannot be configured. */
-void socket_set_ratelimit(struct socket *s);
+/* Token bucket rate limiting of the sent data. The rates are in bytes per
+ * second, the bucket sizes (the maximum bursts) in bytes; zero rate means
+ * no limit. Each rate limited socket has its own bucket which is a child of
+ * a group bucket, which is in turn a child of the process-wide bucket. Data
+ * are sent only when all of the buckets allow it. */
+
+/* Returns a new group bucket, full. */
+struct ratelimit *ratelimit_new(int rate, int size);
+/* Changes the parameters of the bucket. The tokens are kept. */
+void ratelimit_set(struct ratelimit *rl, int rate, int size);
+/* Sets the process-wide bucket. There's no limit by default. */
+void socket_set_process_ratelimit(int rate, int size);
+/* Sets the socket as rate limited or changes its limit. With NULL "group",
+ * the socket is directly under the process-wide bucket. */
+void socket_set_ratelimit(struct socket *s, int rate, int size,
+			  struct ratelimit *group);
 
+/* Makes small writes go out right away on TCP sockets, for responses to
+ * pipelined requests. */
+int socket_set_nodelay(struct socket *s);
 int socket_stop_reading(struct socket *s);
 int socket_pause(struct socket *s, bool pause);
 
@@ -49,10 +72,51 @@ void socket_unref(struct socket *s);
 size_t socket_read(struct socket *s, void *buf, size_t size);
 size_t socket_read_ancil(struct socket *s, void *buf, size_t size,
 			 void *ancil_buf, size_t *ancil_size);
+/* The socket's input buffer. socket_fill reads the available data to the
+ * buffer and returns the number of bytes read, zero if there's nothing to
+ * read. socket_input returns all the unconsumed data; what is not consumed
+ * by socket_consume is kept for the next read, e.g. a partial message. On
+ * sockets with message boundaries, each fill reads one message, which
+ * should be consumed whole. With io_uring, stream sockets receive the data
+ * before cb_read is called, socket_fill then returns them. */
+size_t socket_fill(struct socket *s);
+size_t socket_fill_ancil(struct socket *s, void *ancil_buf,
+			 size_t *ancil_size);
+void *socket_input(struct socket *s, size_t *len);
+void socket_consume(struct socket *s, size_t len);
+/* Appends data to the input buffer as if it was read from the socket. */
+void socket_push_input(struct socket *s, void *buf, size_t len);
+/* Sets the maximum size of the input buffer, i.e. of the largest message
+ * on sockets with message boundaries. The default is 64 KiB for stream
+ * sockets and 4 KiB for the others. */
+void socket_set_input_max(struct socket *s, size_t size);
 int socket_write(struct socket *s, void *buf, size_t size, bool steal);
+/* With "close_fds", the fds passed in "ancil_buf" (SCM_RIGHTS) are closed
+ * once sent, or when the message is dropped. */
 int socket_write_ancil(struct socket *s, void *buf, size_t size, bool steal,
 		       void *ancil_buf, size_t ancil_size, bool ancil_steal,
-		       int fd_to_close);
+		       bool close_fds);
+
+/* Fills "buf" of "size" bytes with the next part of the message, returns
+ * the number of bytes stored. Sets "*done" with the last part. */
+typedef size_t (*socket_produce_t)(void *buf, size_t size, bool *done,
+				   void *data);
+/* Queues a message whose data are generated only as the queue drains:
+ * "produce" is called for the next chunk whenever the message gets to the
+ * head of the queue, then "data" is freed by "destructor". "held" is the
+ * memory kept by the producer, counted towards the queue size for the
+ * backpressure. The message is not subject to the queue size limit. */
+int socket_write_producer(struct socket *s, socket_produce_t produce,
+			  void *data, cb_data_destructor_t destructor,
+			  size_t held);
+
+/* Returns a buffer with one reference. Fill in the data before queuing
+ * it. */
+struct sbuf *sbuf_new(size_t size);
+void *sbuf_data(struct sbuf *b);
+void sbuf_unref(struct sbuf *b);
+/* Queues the buffer, taking a new reference. */
+int socket_write_sbuf(struct socket *s, struct sbuf *b);
 
 /* Use carefully. Do not store the returned fd anywhere, do not perform I/O
  * that could interfere with the socket management core operations. */
@@ -67,4 +131,25 @@ int socket_listen(unsigned port, socket_cb_new_t cb_new,
 		  socket_cb_read_t cb_read,
 		  cb_data_destructor_t cb_destructor);
 
+/* The same for a Unix domain socket. A "path" starting with '@' is a name
+ * in the abstract namespace. A socket file left at "path" is replaced. */
+int socket_listen_unix(const char *path, socket_cb_new_t cb_new,
+		       socket_cb_read_t cb_read,
+		       cb_data_destructor_t cb_destructor);
+
+/* Gives the socket "msec" miliseconds to complete its handshake, i.e. to be
+ * deleted by the caller (usually when handed off to a child). After an
+ * initial grace period, it also has to keep receiving at least "min_rate"
+ * bytes per second on average, unless "min_rate" is zero. A socket failing
+ * either is deleted. */
+void socket_set_handshake_deadline(struct socket *s, int msec, int min_rate);
+
+/* Connections from a single address are limited in number and rate; the
+ * excess ones are closed right after accept. Logs the statistics. */
+void socket_log_stats(void);
+
+/* Makes the subsequently created listening sockets use SO_REUSEPORT, so
+ * that several processes can listen on the same port. */
+void socket_set_reuse_port(bool reuse);
+
 #endif
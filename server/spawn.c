@@ -1,35 +1,136 @@
 #include "spawn.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include "common.h"
+#include "config.h"
 #include "db.h"
 #include "event.h"
+#include "ipc.h"
 #include "log.h"
+#include "pybindings.h"
+#include "socket.h"
 
 static char *prg_path;
 static bool use_syslog;
+static bool use_uring;
+static int linger;
 
-void spawn_init(char *argv0, bool use_syslog_)
+void spawn_init(char *argv0, bool use_syslog_, bool use_uring_, int linger_)
 {
 	prg_path = sstrdup(argv0);
 	use_syslog = use_syslog_;
+	use_uring = use_uring_;
+	linger = linger_;
 }
 
-int spawn(const char *login)
+/* Executes this program again with the common options and the given
+ * argument. */
+static void exec_self(const char *arg)
+{
+	char linger_str[12];
+	char *argv[7];
+	int argc = 0;
+
+	argv[argc++] = prg_path;
+	if (use_syslog)
+		argv[argc++] = "-s";
+	if (use_uring)
+		argv[argc++] = "-u";
+	if (linger) {
+		snprintf(linger_str, sizeof(linger_str), "%d", linger);
+		argv[argc++] = "-l";
+		argv[argc++] = linger_str;
+	}
+	argv[argc++] = (char *)arg;
+	argv[argc] = NULL;
+	execvp(prg_path, argv);
+}
+
+/* Makes "fd" available as "target" in an exec'ed program. */
+static int move_fd(int fd, int target)
+{
+	if (fd == target)
+		return fcntl(fd, F_SETFD, 0);
+	return dup2(fd, target);
+}
+
+/*** Zygote ***/
+
+/* The zygote is a process with the Python interpreter already initialized
+ * and the Python levels compiled. It forks the children on request of the
+ * master, without exec, so that the children start quickly and share the
+ * preloaded pages. The zygote reports the pids of the started children
+ * and their exit status to the master. */
+
+#define ZYGOTE_FD	3
+
+/* master -> zygote, carries the child end of the child pipe */
+struct zygote_req {
+	char login[LOGIN_LEN + 1];
+};
+
+/* zygote -> master */
+struct zygote_msg {
+	pid_t pid;
+	bool exited;
+	int status;
+	char login[LOGIN_LEN + 1];
+};
+
+/* in the master, the channel to the zygote */
+static struct socket *zygote;
+static pid_t zygote_pid;
+
+static void pool_set_pid(pid_t pid);
+static void pool_drop_unknown(void);
+
+static void zygote_read(struct socket *s, void *data __unused)
+{
+	struct zygote_msg msg;
+	size_t len;
+
+	while ((len = socket_read(s, &msg, sizeof(msg)))) {
+		if (len != sizeof(msg)) {
+			log_warn("received malformed message from the zygote");
+			continue;
+		}
+		if (msg.exited) {
+			log_info("zygote child %d exited (%d)", msg.pid, msg.status);
+			spawn_child_exited(msg.pid, msg.status);
+		} else {
+			msg.login[LOGIN_LEN] = '\0';
+			if (msg.login[0])
+				db_set_pid(msg.login, msg.pid);
+			else
+				pool_set_pid(msg.pid);
+		}
+	}
+}
+
+int spawn_zygote(void)
 {
 	pid_t pid;
 	int fd[2];
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+	/* message boundaries are needed */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd) < 0)
 		return -errno;
 	if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0)
 		goto error;
+	/* children of a crashed zygote are reparented to us */
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+		goto error;
 
 	pid = fork();
 	if (pid < 0)
@@ -37,17 +138,480 @@ int spawn(const char *login)
 	if (pid > 0) {
 		/* parent */
 		close(fd[1]);
-		db_start_process(login, pid, fd[0]);
+		zygote = socket_add(fd[0], zygote_read, NULL, NULL);
+		if (!zygote)
+			return -ENOTSOCK;
+		socket_ref(zygote);
+		zygote_pid = pid;
+		log_info("started zygote pid %d", pid);
 		return 0;
 	}
 	close(fd[0]);
+	if (move_fd(fd[1], ZYGOTE_FD) < 0)
+		exit(10);
+	exec_self("--zygote-process");
+	exit(11);
+
+error: ;
+	int ret = -errno;
+
+	close(fd[0]);
+	close(fd[1]);
+	return ret;
+}
+
+static void zygote_exited(void)
+{
+	/* process the reports sent before the exit */
+	zygote_read(zygote, NULL);
+	socket_del(zygote);
+	socket_unref(zygote);
+	zygote = NULL;
+	zygote_pid = 0;
+	log_warn("zygote terminated, spawning the children by exec");
+	pool_drop_unknown();
+}
+
+/* The pid is not known until reported by the zygote. */
+static int zygote_spawn(const char *login, int fd[2])
+{
+	struct zygote_req req;
+
+	memset(&req, 0, sizeof(req));
+	strlcpy(req.login, login, sizeof(req.login));
+	/* fd[1] is closed once sent */
+	return ipc_send_fd(zygote, fd[1], &req, sizeof(req));
+}
+
+static volatile sig_atomic_t zygote_sigchld;
+
+static void zygote_sig_handler(int sig __unused)
+{
+	zygote_sigchld = 1;
+}
+
+static void zygote_report(pid_t pid, bool exited, int status, const char *login)
+{
+	struct zygote_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.pid = pid;
+	msg.exited = exited;
+	msg.status = status;
+	if (login)
+		strlcpy(msg.login, login, sizeof(msg.login));
+	if (send(ZYGOTE_FD, &msg, sizeof(msg), MSG_NOSIGNAL) < 0)
+		log_err("cannot report pid %d to the master: %s", pid, strerror(errno));
+}
+
+/* Receives a request from the master. Returns the child pipe fd, or -1 if
+ * there's none. */
+static int zygote_recv(struct zygote_req *req)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		char ancil[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr cmsg;
+	} u;
+	ssize_t len;
+	int fd;
+
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = u.ancil;
+	mh.msg_controllen = sizeof(u.ancil);
+
+	len = recvmsg(ZYGOTE_FD, &mh, MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		return -1;
+	if (!len) {
+		log_info("master has gone away, terminating");
+		exit(0);
+	}
+	if (mh.msg_controllen < CMSG_LEN(sizeof(int)) ||
+	    u.cmsg.cmsg_level != SOL_SOCKET || u.cmsg.cmsg_type != SCM_RIGHTS) {
+		log_warn("received request with no fd");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(&u.cmsg), sizeof(int));
+	if (len != sizeof(*req)) {
+		log_warn("received malformed request");
+		close(fd);
+		return -1;
+	}
+	req->login[LOGIN_LEN] = '\0';
+	return fd;
+}
+
+char *spawn_zygote_run(void)
+{
+	static struct zygote_req req;
+	struct sigaction sa;
+	sigset_t sigs, orig_sigs, wait_sigs;
+	struct pollfd pfd;
+	pid_t pid;
+	int status, fd;
+
+	/* SIGCHLD is delivered only while waiting in ppoll */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = zygote_sig_handler;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, &orig_sigs);
+	wait_sigs = orig_sigs;
+	sigdelset(&wait_sigs, SIGCHLD);
+
+	while (true) {
+		pfd.fd = ZYGOTE_FD;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (ppoll(&pfd, 1, NULL, &wait_sigs) < 0 && errno != EINTR) {
+			log_err("ppoll error: %s", strerror(errno));
+			exit(1);
+		}
+		if (zygote_sigchld) {
+			zygote_sigchld = 0;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+				zygote_report(pid, true, status, NULL);
+		}
+		if (!pfd.revents)
+			continue;
+
+		fd = zygote_recv(&req);
+		if (fd < 0)
+			continue;
+		pid = pyb_fork();
+		if (pid < 0) {
+			log_err("cannot fork child [%s]: %s", req.login, strerror(errno));
+			close(fd);
+			continue;
+		}
+		if (!pid) {
+			/* child */
+			sa.sa_handler = SIG_DFL;
+			sigaction(SIGCHLD, &sa, NULL);
+			sigprocmask(SIG_SETMASK, &orig_sigs, NULL);
+			close(ZYGOTE_FD);
+			if (dup2(fd, 2) < 0)
+				exit(10);
+			close(fd);
+			return req.login;
+		}
+		close(fd);
+		zygote_report(pid, false, 0, req.login);
+	}
+}
+
+/*** Children ***/
+
+static void pipe_read(struct socket *s, void *data __unused)
+{
+	char *buf;
+	size_t len;
+
+	/* the child's stderr and the messages from the child, one per
+	 * packet */
+	while (true) {
+		socket_fill(s);
+		buf = socket_input(s, &len);
+		if (len == sizeof(struct ipc_child_msg) && !buf[0]) {
+			struct ipc_child_msg msg;
+
+			memcpy(&msg, buf, sizeof(msg));
+			db_child_idle(s, msg.idle);
+		} else {
+			log_raw(buf, len);
+		}
+		socket_consume(s, len);
+		if (!len)
+			break;
+	}
+}
+
+static int exec_spawn(const char *login, int fd[2], pid_t *pid)
+{
+	*pid = fork();
+	if (*pid < 0)
+		return -errno;
+	if (*pid > 0)
+		return 0;
+	close(fd[0]);
 	if (dup2(fd[1], 2) < 0)
 		exit(10);
 	close(fd[1]);
-	if (use_syslog)
-		execlp(prg_path, prg_path, "-s", login, NULL);
+	exec_self(*login ? login : "--pooled");
+	exit(11);
+}
+
+/* Starts a new child for the given login, or a pooled child if the login is
+ * empty. The pid is 0 if not known yet. */
+static int start_child(const char *login, struct socket **pipe, pid_t *pid)
+{
+	int fd[2];
+	int ret;
+
+	/* SOCK_SEQPACKET keeps the child's messages apart from its log
+	 * output */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd) < 0)
+		return -errno;
+	if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0) {
+		ret = -errno;
+		goto error;
+	}
+	*pid = 0;
+	if (zygote)
+		ret = zygote_spawn(login, fd);
 	else
-		execlp(prg_path, prg_path, login, NULL);
+		ret = exec_spawn(login, fd, pid);
+	if (ret < 0)
+		goto error;
+	if (!zygote)
+		close(fd[1]);
+
+	*pipe = socket_add(fd[0], pipe_read, NULL, NULL);
+	if (!*pipe) {
+		/* the child will terminate right away */
+		close(fd[0]);
+		return -ENOTSOCK;
+	}
+	socket_ref(*pipe);
+	return 0;
+
+error:
+	close(fd[0]);
+	close(fd[1]);
+	return ret;
+}
+
+long spawn_get_rss(pid_t pid)
+{
+	char path[32];
+	FILE *f;
+	long size, rss;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "%ld %ld", &size, &rss);
+	fclose(f);
+	if (ret != 2)
+		return -EINVAL;
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+/*** Pool ***/
+
+/* Idle children started in advance, not bound to any login yet. A pooled
+ * child waits for the login (see spawn_wait_bind) before initializing. */
+
+#define POOL_REFILL_DELAY	10
+#define POOL_RETRY_DELAY	1000
+
+struct pooled {
+	pid_t pid;
+	struct socket *pipe;
+};
+
+struct bind_msg {
+	char login[LOGIN_LEN + 1];
+};
+
+static struct pooled *pool;
+static int pool_size;
+static int pool_cnt;
+static int pool_timer = -1;
+static unsigned long pool_hits, pool_misses;
+
+/* Shifts the following entries: those without a pid have to stay in the
+ * order of the requests, see pool_set_pid. */
+static void pool_unlink(int idx)
+{
+	pool_cnt--;
+	memmove(pool + idx, pool + idx + 1, (pool_cnt - idx) * sizeof(*pool));
+}
+
+static void pool_remove(int idx)
+{
+	socket_del(pool[idx].pipe);
+	socket_unref(pool[idx].pipe);
+	pool_unlink(idx);
+}
+
+static int pool_refill(int fd __unused, int count __unused, void *data __unused)
+{
+	struct pooled *p;
+	int ret;
+
+	while (pool_cnt < pool_size) {
+		p = &pool[pool_cnt];
+		ret = start_child("", &p->pipe, &p->pid);
+		if (ret < 0) {
+			log_err("cannot start pooled child: %s (%d)", strerror(-ret), -ret);
+			timer_arm(pool_timer, POOL_RETRY_DELAY, false);
+			break;
+		}
+		pool_cnt++;
+	}
+	return 0;
+}
+
+static void pool_schedule_refill(void)
+{
+	/* refill outside of the connection handling */
+	if (pool_timer >= 0)
+		timer_arm(pool_timer, POOL_REFILL_DELAY, false);
+}
+
+int spawn_pool(int size)
+{
+	pool = szalloc(size * sizeof(*pool));
+	pool_size = size;
+	pool_cnt = 0;
+	pool_hits = pool_misses = 0;
+	pool_timer = timer_new(pool_refill, NULL, NULL);
+	if (pool_timer < 0)
+		return pool_timer;
+	pool_schedule_refill();
+	return 0;
+}
+
+static void pool_set_pid(pid_t pid)
+{
+	/* the zygote processes the requests in order */
+	for (int i = 0; i < pool_cnt; i++) {
+		if (!pool[i].pid) {
+			pool[i].pid = pid;
+			return;
+		}
+	}
+	log_err("unexpected pid %d reported for a pooled child", pid);
+}
+
+/* Drops the pooled children whose pids will never be reported. */
+static void pool_drop_unknown(void)
+{
+	for (int i = pool_cnt - 1; i >= 0; i--)
+		if (!pool[i].pid)
+			pool_remove(i);
+	pool_schedule_refill();
+}
+
+static bool pool_child_exited(pid_t pid)
+{
+	for (int i = 0; i < pool_cnt; i++) {
+		if (pool[i].pid == pid) {
+			pool_remove(i);
+			pool_schedule_refill();
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Binds a pooled child to the login. Returns false if there's no ready
+ * child. */
+static bool pool_take(const char *login)
+{
+	struct bind_msg msg;
+
+	for (int i = pool_cnt - 1; i >= 0; i--) {
+		struct pooled p = pool[i];
+
+		if (!p.pid)
+			continue;
+		memset(&msg, 0, sizeof(msg));
+		strlcpy(msg.login, login, sizeof(msg.login));
+		if (socket_write(p.pipe, &msg, sizeof(msg), false) < 0)
+			continue;
+		pool_unlink(i);
+		db_start_process(login, p.pid, p.pipe);
+		log_info("bound pooled child %d to [%s]", p.pid, login);
+		return true;
+	}
+	return false;
+}
+
+char *spawn_wait_bind(void)
+{
+	static struct bind_msg msg;
+	ssize_t len;
+
+	do {
+		len = recv(2, &msg, sizeof(msg), MSG_WAITALL);
+	} while (len < 0 && errno == EINTR);
+	if (len != sizeof(msg))
+		/* the master has gone away */
+		exit(0);
+	msg.login[LOGIN_LEN] = '\0';
+	return msg.login;
+}
+
+void spawn_log_stats(void)
+{
+	if (pool_size)
+		log_info("pool: %d of %d children, %lu hits, %lu misses",
+			 pool_cnt, pool_size, pool_hits, pool_misses);
+}
+
+int spawn(const char *login)
+{
+	struct socket *pipe;
+	pid_t pid;
+	int ret;
+
+	if (pool_size) {
+		pool_schedule_refill();
+		if (pool_take(login)) {
+			pool_hits++;
+			return 0;
+		}
+		pool_misses++;
+	}
+	ret = start_child(login, &pipe, &pid);
+	if (ret < 0)
+		return ret;
+	db_start_process(login, pid, pipe);
+	return 0;
+}
+
+/*** Master workers ***/
+
+static pid_t *workers;
+static int workers_cnt;
+static bool workers_stopping;
+
+static int spawn_worker(int idx)
+{
+	pid_t pid;
+	int fd[2];
+
+	/* message boundaries are needed, see ipc_worker_init */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd) < 0)
+		return -errno;
+	if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0)
+		goto error;
+
+	pid = fork();
+	if (pid < 0)
+		goto error;
+	if (pid > 0) {
+		/* parent */
+		close(fd[1]);
+		workers[idx] = pid;
+		log_info("started worker %d pid %d", idx, pid);
+		return ipc_worker_add(fd[0]);
+	}
+	close(fd[0]);
+	if (move_fd(fd[1], IPC_WORKER_FD) < 0)
+		exit(10);
+	exec_self("--worker");
 	exit(11);
 
 error: ;
@@ -58,6 +622,62 @@ error: ;
 	return ret;
 }
 
+int spawn_workers(int count)
+{
+	int ret;
+
+	workers = szalloc(count * sizeof(*workers));
+	workers_cnt = count;
+	workers_stopping = false;
+	for (int i = 0; i < count; i++) {
+		ret = spawn_worker(i);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static bool worker_exited(pid_t pid, int status)
+{
+	int ret;
+
+	for (int i = 0; i < workers_cnt; i++) {
+		if (workers[i] != pid)
+			continue;
+		workers[i] = 0;
+		if (workers_stopping)
+			return true;
+		if (WIFEXITED(status) && WEXITSTATUS(status)) {
+			/* failed to start, e.g. cannot listen */
+			log_err("worker %d failed, terminating", i);
+			event_quit();
+			return true;
+		}
+		ret = spawn_worker(i);
+		if (ret < 0)
+			log_err("cannot restart worker %d: %s (%d)", i, strerror(-ret), -ret);
+		return true;
+	}
+	return false;
+}
+
+void spawn_signal_workers(int sig)
+{
+	if (sig == SIGTERM)
+		workers_stopping = true;
+	for (int i = 0; i < workers_cnt; i++)
+		if (workers[i])
+			kill(workers[i], sig);
+}
+
+void spawn_child_exited(pid_t pid, int status)
+{
+	if (zygote && pid == zygote_pid)
+		zygote_exited();
+	else if (!worker_exited(pid, status) && !pool_child_exited(pid))
+		db_end_process(pid);
+}
+
 static char **va_list_to_argv(char *prg, va_list ap)
 {
 	va_list copy;
@@ -1,12 +1,47 @@
 #ifndef SPAWN_H
 #define SPAWN_H
 #include <stdbool.h>
+#include <sys/types.h>
 
-void spawn_init(char *argv0, bool use_syslog);
+/* "linger" is passed to the children, see proto_client_init. */
+void spawn_init(char *argv0, bool use_syslog, bool use_uring, int linger);
 
 /* The caller is responsible for checking that the given login exists. */
 int spawn(const char *login);
 
+/* Returns the resident memory of the given child in bytes, or a negative
+ * error code. */
+long spawn_get_rss(pid_t pid);
+
+/* Starts a pool of the given size of children not bound to any login. A
+ * new login then gets a pooled child instead of starting a new one. */
+int spawn_pool(int size);
+
+/* In a pooled child, waits until it is bound. Returns the login. */
+char *spawn_wait_bind(void);
+
+/* Logs the pool statistics. */
+void spawn_log_stats(void);
+
+/* Starts the zygote. The children are then forked from it instead of being
+ * exec'ed. */
+int spawn_zygote(void);
+
+/* Runs the zygote loop in the zygote process. Returns only in the forked
+ * children, the return value is the login to serve. */
+char *spawn_zygote_run(void);
+
+/* To be called for each exited (and reaped) child process. */
+void spawn_child_exited(pid_t pid, int status);
+
+/* Starts the given number of master workers, each accepting connections on
+ * its own listening sockets (bound with SO_REUSEPORT) and passing the
+ * resulting fds back to this process, which owns the user table and routes
+ * them to the children. Exited workers are restarted. */
+int spawn_workers(int count);
+
+void spawn_signal_workers(int sig);
+
 int exec_wait(char *out, int out_size, char *prg, ...);
 
 #endif
@@ -0,0 +1,171 @@
+#!/usr/bin/python3
+# Benchmarks a running server.
+#
+# By default, measures the latency of command round trips; start the server
+# with and without --uring to compare the event backends. The default count
+# is low enough not to hit the rate limit.
+#
+# With --spawn, measures the time to get a level loaded by a freshly started
+# child, i.e. from connecting to the LEVL response; start the server with
+# and without --zygote to compare the spawning modes.
+#
+# With --unix PATH, connects to the Unix socket given to the server by
+# --app-socket instead of the TCP port.
+#
+# With --pipeline DEPTH, asks for pipelining at LEVL and keeps up to DEPTH
+# commands in flight in the round trip measurement.
+#
+# With --maze, measures MAZE round trips; use a level with a large maze
+# and the rate limits disabled to see the cost of the serialization.
+#
+# With --allocs LOG, counts the system allocator calls per MOVE round trip.
+# The server has to log to the file LOG (stderr, not syslog); the counters
+# are obtained by sending SIGUSR1 to the mazec processes before and after
+# the run.
+import argparse
+import os
+import re
+import signal
+import socket
+import sys
+import time
+
+# the child terminates after 500 ms with no connection
+IDLE_WAIT = 0.8
+
+parser = argparse.ArgumentParser()
+parser.add_argument('login')
+parser.add_argument('level')
+parser.add_argument('-n', '--count', type=int)
+parser.add_argument('-s', '--spawn', action='store_true',
+                    help='measure the spawn latency')
+parser.add_argument('-u', '--unix', metavar='PATH',
+                    help='connect to a Unix socket, @NAME for abstract')
+parser.add_argument('-a', '--allocs', metavar='LOG',
+                    help='count allocator calls, reading the server log LOG')
+parser.add_argument('-p', '--pipeline', metavar='DEPTH', type=int,
+                    help='keep up to DEPTH commands in flight')
+parser.add_argument('-m', '--maze', action='store_true',
+                    help='measure MAZE round trips')
+args = parser.parse_args()
+
+
+class Conn:
+    def __init__(self):
+        if args.unix:
+            self.sock = socket.socket(socket.AF_UNIX)
+            self.sock.connect(args.unix.replace('@', '\0', 1)
+                              if args.unix.startswith('@') else args.unix)
+        else:
+            self.sock = socket.create_connection(('localhost', 4000))
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.f = self.sock.makefile('rb')
+
+    def command(self, cmd):
+        self.sock.sendall(cmd.encode() + b'\n')
+        return self.f.readline().decode().strip()
+
+    def start(self):
+        self.depth = 1
+        levl = 'LEVL ' + args.level
+        if args.pipeline:
+            levl += ' {}'.format(args.pipeline)
+        for cmd in ('USER ' + args.login, levl):
+            res = self.command(cmd)
+            if res.startswith('DATA ') and args.pipeline:
+                self.depth = int(res[5:])
+            elif res != 'DONE':
+                sys.stderr.write("{}: {}\n".format(cmd, res))
+                sys.exit(1)
+
+    def pipelined(self, cmd, count):
+        """Sends the command "count" times, keeping up to self.depth
+        commands in flight."""
+        line = cmd.encode() + b'\n'
+        sent = min(count, self.depth)
+        self.sock.sendall(line * sent)
+        for i in range(count):
+            self.f.readline()
+            if sent < count:
+                self.sock.sendall(line)
+                sent += 1
+
+    def close(self):
+        self.f.close()
+        self.sock.close()
+
+
+def report(what, count, elapsed):
+    print("{} {} in {:.3f} s, {:.1f} us per {}".format(
+          count, what, elapsed, elapsed / count * 1e6, what[:-1]))
+
+
+def alloc_counters(log):
+    """Makes the child log its allocator statistics and returns the
+    number of allocations and frees."""
+    pos = os.path.getsize(log)
+    for pid in os.listdir('/proc'):
+        try:
+            with open('/proc/{}/comm'.format(pid)) as f:
+                if f.read().strip() == 'mazec':
+                    os.kill(int(pid), signal.SIGUSR1)
+        except (OSError, ValueError):
+            pass
+    pattern = re.compile(r'\[{}:\d+\] allocator: (\d+) allocations, '
+                         r'(\d+) frees'.format(re.escape(args.login)))
+    for i in range(50):
+        time.sleep(0.02)
+        with open(log) as f:
+            f.seek(pos)
+            m = pattern.search(f.read())
+        if m:
+            return int(m.group(1)), int(m.group(2))
+    sys.stderr.write("no allocator statistics in {}\n".format(log))
+    sys.exit(1)
+
+
+if args.allocs:
+    count = args.count or 1000
+    conn = Conn()
+    conn.start()
+    before = alloc_counters(args.allocs)
+    for i in range(count):
+        conn.command('MOVE ' + 'ws'[i % 2])
+    after = alloc_counters(args.allocs)
+    conn.close()
+    print("{} round trips: {:.2f} allocations, {:.2f} frees per MOVE".format(
+          count, (after[0] - before[0]) / count,
+          (after[1] - before[1]) / count))
+elif args.spawn:
+    count = args.count or 20
+    elapsed = 0
+    for i in range(count):
+        time.sleep(IDLE_WAIT)
+        start = time.perf_counter()
+        conn = Conn()
+        conn.start()
+        elapsed += time.perf_counter() - start
+        conn.close()
+    report('spawns', count, elapsed)
+elif args.maze:
+    count = args.count or 200
+    conn = Conn()
+    conn.start()
+    start = time.perf_counter()
+    size = 0
+    for i in range(count):
+        size += len(conn.command('MAZE'))
+    elapsed = time.perf_counter() - start
+    conn.close()
+    report('round trips', count, elapsed)
+    print("{:.0f} bytes per response, {:.1f} MB/s".format(
+          size / count, size / elapsed / 1e6))
+else:
+    count = args.count or 5000
+    conn = Conn()
+    conn.start()
+    start = time.perf_counter()
+    conn.pipelined('GETX', count)
+    report('commands' if args.pipeline else 'round trips', count,
+           time.perf_counter() - start)
+    conn.close()
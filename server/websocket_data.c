@@ -9,7 +9,6 @@
 #include "log.h"
 #include "socket.h"
 
-#define BUF_SIZE		1024
 #define MAX_PAYLOAD_SIZE	4096
 
 #define OP_CONT		0x00
@@ -21,15 +20,8 @@
 
 struct ws_data {
 	struct socket *s;
-	unsigned offset;
-	char *payload;
-	size_t payload_size;
-	size_t payload_len;
-
-	char mask[4];
 	bool fin;
 	unsigned char opcode;
-	unsigned char payload_enc_len;
 
 	unsigned char reasm_opcode;
 	char *reassembled;
@@ -38,6 +30,8 @@ struct ws_data {
 	struct ws_data *next;
 };
 
+SLAB_POOL(ws_data_pool, struct ws_data);
+
 static websocket_cb_t ws_cb;
 static websocket_close_cb_t ws_close_cb;
 static struct ws_data *websockets;
@@ -52,43 +46,57 @@ static void ws_free(void *data)
 		;
 	if (*ptr)
 		*ptr = wsd->next;
-	sfree(wsd);
+	slab_free(&ws_data_pool, wsd);
 	if (!--ws_count && ws_close_cb)
 		ws_close_cb();
 }
 
-static void ws_write(struct socket *s, unsigned opcode, void *buf, size_t size)
+/* Builds a frame with the given payload. */
+static struct sbuf *ws_frame(unsigned opcode, void *buf, size_t size)
 {
-	char hdr[6];
+	struct sbuf *frame;
+	char *msg;
 	unsigned payload_enc_len;
 	size_t tmp;
-	void *msg;
 
-	hdr[0] = opcode | 0x80;
-	if (size <= 125) {
-		hdr[1] = size;
+	if (size <= 125)
 		payload_enc_len = 0;
-	} else if (size <= 0xffff) {
-		hdr[1] = 126;
+	else if (size <= 0xffff)
 		payload_enc_len = 2;
-	} else {
-		hdr[1] = 127;
+	else
 		payload_enc_len = 4;
-	}
+	frame = sbuf_new(2 + payload_enc_len + size);
+	msg = sbuf_data(frame);
+
+	msg[0] = opcode | 0x80;
+	if (payload_enc_len == 0)
+		msg[1] = size;
+	else if (payload_enc_len == 2)
+		msg[1] = 126;
+	else
+		msg[1] = 127;
 	tmp = size;
 	for (int i = payload_enc_len - 1; i >= 0; i--) {
-		hdr[2 + i] = tmp & 0xff;
+		msg[2 + i] = tmp & 0xff;
 		tmp >>= 8;
 	}
-
-	msg = salloc(2 + payload_enc_len + size);
-	memcpy(msg, hdr, 2 + payload_enc_len);
 	memcpy(msg + 2 + payload_enc_len, buf, size);
+	return frame;
+}
 
-	if (socket_write(s, msg, 2 + payload_enc_len + size, true) < 0) {
-		sfree(msg);
+static void ws_send_frame(struct socket *s, struct sbuf *frame)
+{
+	if (socket_write_sbuf(s, frame) < 0)
 		socket_del(s);
-	}
+}
+
+static void ws_write(struct socket *s, unsigned opcode, void *buf, size_t size)
+{
+	struct sbuf *frame;
+
+	frame = ws_frame(opcode, buf, size);
+	ws_send_frame(s, frame);
+	sbuf_unref(frame);
 }
 
 static void ws_error(struct socket *s, uint16_t code)
@@ -98,14 +106,6 @@ static void ws_error(struct socket *s, uint16_t code)
 	socket_flush_and_del(s);
 }
 
-static void reset_message(struct ws_data *wsd)
-{
-	if (wsd->payload)
-		sfree(wsd->payload);
-	wsd->payload = NULL;
-	wsd->offset = 0;
-}
-
 static void reset_reassembly(struct ws_data *wsd)
 {
 	if (wsd->reassembled)
@@ -115,141 +115,116 @@ static void reset_reassembly(struct ws_data *wsd)
 	wsd->reasm_opcode = 0;
 }
 
-static void reassembly_message(struct ws_data *wsd)
+static void reassembly_message(struct ws_data *wsd, char *payload, size_t len)
 {
 	if (!wsd->reasm_opcode) {
 		wsd->reasm_opcode = wsd->opcode;
-		wsd->reassembled = wsd->payload;
-		wsd->reassembled_len = wsd->payload_len;
-		wsd->payload = NULL;
-	} else if (wsd->payload_len > 0) {
-		if (!wsd->reassembled) {
-			wsd->reassembled = wsd->payload;
-			wsd->reassembled_len = wsd->payload_len;
-			wsd->payload = NULL;
-		} else {
-			char *new;
-
-			if (wsd->reassembled_len + wsd->payload_len > MAX_PAYLOAD_SIZE)
-				goto error;
-			new = srealloc(wsd->reassembled, wsd->reassembled_len + wsd->payload_len);
-			wsd->reassembled = new;
-			memcpy(new + wsd->reassembled_len, wsd->payload, wsd->payload_len);
-			wsd->reassembled_len += wsd->payload_len;
+		if (wsd->fin) {
+			/* not fragmented, no need to copy */
+			if (len)
+				/* ignore empty messages */
+				ws_cb(wsd->s, payload, len);
+			wsd->reasm_opcode = 0;
+			return;
 		}
 	}
+	if (len > 0) {
+		if (wsd->reassembled_len + len > MAX_PAYLOAD_SIZE)
+			goto error;
+		wsd->reassembled = srealloc(wsd->reassembled,
+					    wsd->reassembled_len + len);
+		memcpy(wsd->reassembled + wsd->reassembled_len, payload, len);
+		wsd->reassembled_len += len;
+	}
 	if (!wsd->fin)
 		return;
 
 	if (wsd->reassembled_len)
-		/* ignore empty messages */
 		ws_cb(wsd->s, wsd->reassembled, wsd->reassembled_len);
 
 error:
 	reset_reassembly(wsd);
 }
 
-static int consume_message(struct ws_data *wsd)
+static int consume_message(struct ws_data *wsd, char *payload, size_t len)
 {
-	int ret = 0;
-
 	switch (wsd->opcode) {
 	case OP_CONT:
-		if (!wsd->reasm_opcode) {
-			ret = -EINVAL;
-			goto error;
-		}
-		reassembly_message(wsd);
+		if (!wsd->reasm_opcode)
+			return -EINVAL;
+		reassembly_message(wsd, payload, len);
 		break;
 	case OP_TEXT:
-		ret = -EOPNOTSUPP;
-		goto error;
+		return -EOPNOTSUPP;
 	case OP_BINARY:
 		if (wsd->reasm_opcode)
 			reset_reassembly(wsd);
-		reassembly_message(wsd);
+		reassembly_message(wsd, payload, len);
 		break;
 	case OP_CLOSE:
-		ret = -EPIPE;
-		goto error;
+		return -EPIPE;
 	case OP_PING:
-		ws_write(wsd->s, OP_PONG, wsd->payload, wsd->payload_len);
-		sfree(wsd->payload);
-		wsd->payload = NULL;
+		ws_write(wsd->s, OP_PONG, payload, len);
 		break;
 	case OP_PONG:
 		/* ignore */ ;
 	}
-
-error:
-	reset_message(wsd);
-	return ret;
+	return 0;
 }
 
-static int process_chunk(struct ws_data *wsd, char *buf, size_t len)
+/* Processes the complete frames in "buf", the number of consumed bytes is
+ * stored to "used". The payload is unmasked in place. */
+static int process_frames(struct ws_data *wsd, char *buf, size_t count,
+			  size_t *used)
 {
+	unsigned char *hdr;
+	unsigned payload_enc_len, hdr_len;
+	size_t size;
+	char *payload;
 	int ret;
 
-	for (size_t i = 0; i < len; i++) {
-		char c = buf[i];
-
-		if (!wsd->payload) {
-			/* in header */
-			if (wsd->offset == 0) {
-				/* first byte */
-				wsd->fin = !!(c & 0x80);
-				if (c & 0x70)
-					/* reserved bits */
-					return -EINVAL;
-				wsd->opcode = c & 0x0f;
-				if ((c & 0x07) > 2)
-					/* unknown opcode */
-					return -EINVAL;
-			} else if (wsd->offset == 1) {
-				if (!(c & 0x80))
-					/* mask bit, mandatory for client */
-					return -EINVAL;
-				c &= 0x7f;
-				if (c <= 125) {
-					wsd->payload_enc_len = 0;
-					wsd->payload_size = c;
-				} else if (c == 126) {
-					wsd->payload_enc_len = 2;
-					wsd->payload_size = 0;
-				} else {
-					wsd->payload_enc_len = 4;
-					wsd->payload_size = 0;
-				}
-			} else if (wsd->offset < 2 + (unsigned)wsd->payload_enc_len) {
-				wsd->payload_size <<= 8;
-				wsd->payload_size |= c;
-			} else if (wsd->offset < 6 + (unsigned)wsd->payload_enc_len) {
-				wsd->mask[wsd->offset - 2 -  wsd->payload_enc_len] = c;
-			}
-			wsd->offset++;
-
-			if (wsd->offset == 6 + (unsigned)wsd->payload_enc_len) {
-				if (wsd->payload_size > MAX_PAYLOAD_SIZE)
-					return -ENOSPC;
-				wsd->payload_len = 0;
-				if (wsd->payload_size == 0) {
-					ret = consume_message(wsd);
-					if (ret < 0)
-						return ret;
-				} else {
-					wsd->payload = salloc(wsd->payload_size);
-				}
-			}
-		} else {
-			/* payload */
-			wsd->payload[wsd->payload_len] = c ^ wsd->mask[wsd->payload_len % 4];
-			wsd->payload_len++;
-			if (wsd->payload_len == wsd->payload_size) {
-				ret = consume_message(wsd);
-				if (ret < 0)
-					return ret;
-			}
-		}
+	*used = 0;
+	while (count >= 2) {
+		hdr = (unsigned char *)buf;
+		if (hdr[0] & 0x70)
+			/* reserved bits */
+			return -EINVAL;
+		if ((hdr[0] & 0x07) > 2)
+			/* unknown opcode */
+			return -EINVAL;
+		if (!(hdr[1] & 0x80))
+			/* mask bit, mandatory for client */
+			return -EINVAL;
+		size = hdr[1] & 0x7f;
+		if (size <= 125)
+			payload_enc_len = 0;
+		else if (size == 126)
+			payload_enc_len = 2;
+		else
+			payload_enc_len = 4;
+		hdr_len = 2 + payload_enc_len + 4;
+		if (count < hdr_len)
+			break;
+		if (payload_enc_len)
+			size = 0;
+		for (unsigned i = 0; i < payload_enc_len; i++)
+			size = size << 8 | hdr[2 + i];
+		if (size > MAX_PAYLOAD_SIZE)
+			return -ENOSPC;
+		if (count < hdr_len + size)
+			break;
+
+		wsd->fin = !!(hdr[0] & 0x80);
+		wsd->opcode = hdr[0] & 0x0f;
+		payload = buf + hdr_len;
+		for (size_t i = 0; i < size; i++)
+			payload[i] ^= hdr[hdr_len - 4 + i % 4];
+		ret = consume_message(wsd, payload, size);
+		if (ret < 0)
+			return ret;
+		buf += hdr_len + size;
+		count -= hdr_len + size;
+		*used += hdr_len + size;
 	}
 	return 0;
 }
@@ -257,28 +232,27 @@ static int process_chunk(struct ws_data *wsd, char *buf, size_t len)
 static void ws_read(struct socket *s, void *data)
 {
 	struct ws_data *wsd = data;
-	char buf[BUF_SIZE];
-	size_t count;
+	size_t count, used;
+	char *buf;
 	int ret;
 
-	while (true) {
-		count = socket_read(s, buf, BUF_SIZE);
-		if (!count)
-			break;
-		ret = process_chunk(wsd, buf, count);
+	while (socket_fill(s)) {
+		buf = socket_input(s, &count);
+		ret = process_frames(wsd, buf, count, &used);
+		socket_consume(s, used);
 		if (ret < 0) {
 			log_info("closing websocket fd %d (reason %d)", socket_get_fd(s), ret);
 			switch (ret) {
-			case EINVAL:
+			case -EINVAL:
 				ws_error(s, 1002);
 				break;
-			case EOPNOTSUPP:
+			case -EOPNOTSUPP:
 				ws_error(s, 1003);
 				break;
-			case EPIPE:
+			case -EPIPE:
 				ws_error(s, 1000);
 				break;
-			case ENOSPC:
+			case -ENOSPC:
 				ws_error(s, 1009);
 				break;
 			default:
@@ -294,10 +268,10 @@ int websocket_add(int fd)
 {
 	struct ws_data *wsd;
 
-	wsd = szalloc(sizeof(*wsd));
+	wsd = slab_zalloc(&ws_data_pool);
 	wsd->s = socket_add(fd, ws_read, wsd, ws_free);
 	if (!wsd->s) {
-		sfree(wsd);
+		slab_free(&ws_data_pool, wsd);
 		return -ENOTSOCK;
 	}
 	wsd->next = websockets;
@@ -309,12 +283,18 @@ int websocket_add(int fd)
 void websocket_broadcast(void *buf, size_t size)
 {
 	struct ws_data *wsd;
+	struct sbuf *frame;
 
+	if (!websockets)
+		return;
+	/* one frame shared by all the websockets */
+	frame = ws_frame(OP_BINARY, buf, size);
 	/* This is safe, the websocket removes itself from the 'websockets'
 	 * list in its destructor. All websockets here are thus still
 	 * allocated. */
 	for (wsd = websockets; wsd; wsd = wsd->next)
-		ws_write(wsd->s, OP_BINARY, buf, size);
+		ws_send_frame(wsd->s, frame);
+	sbuf_unref(frame);
 }
 
 bool websocket_connected(void)
@@ -12,6 +12,11 @@
 #define BUF_SIZE	1024
 #define FIELD_MAX_SIZE	32
 
+/* The time to send the request headers, in miliseconds, and the minimum
+ * average rate of the received data in bytes per second. */
+#define HANDSHAKE_TIMEOUT	10000
+#define HANDSHAKE_MIN_RATE	64
+
 struct ws_http_data;
 typedef int (*hdr_process_t)(struct ws_http_data *wsd);
 
@@ -302,7 +307,7 @@ static void ws_headers_sent(struct socket *s __unused, void *data)
 {
 	struct ws_http_data *wsd = data;
 
-	ipc_send_socket(wsd->path + 1, wsd->s, IPC_FD_WEBSOCKET);
+	ipc_send_socket(wsd->path + 1, wsd->s, IPC_FD_WEBSOCKET, NULL, 0);
 }
 
 static char ws_response1[] =
@@ -354,15 +359,15 @@ static int ws_headers_processed(struct ws_http_data *wsd)
 static void ws_header_read(struct socket *s, void *data)
 {
 	struct ws_http_data *wsd = data;
-	char buf[BUF_SIZE];
 	size_t count;
+	char *buf;
 	int ret;
 
-	while (true) {
-		count = socket_read(s, buf, BUF_SIZE);
-		if (!count)
-			break;
+	while (socket_fill(s)) {
+		buf = socket_input(s, &count);
 		ret = process_header_chunk(wsd, buf, count);
+		/* anything after the headers is dropped */
+		socket_consume(s, count);
 		if (ret < 0) {
 			ws_report_error(wsd, ret);
 			return;
@@ -384,6 +389,9 @@ static void *ws_new(struct socket *s)
 	wsd->s = s;
 	wsd->process = process_method;
 	wsd->token_end = ' ';
+	/* counted to the process-wide limit only */
+	socket_set_ratelimit(s, 0, 0, NULL);
+	socket_set_handshake_deadline(s, HANDSHAKE_TIMEOUT, HANDSHAKE_MIN_RATE);
 	return wsd;
 }
 
@@ -402,3 +410,8 @@ int websocket_http_init(unsigned port)
 {
 	return socket_listen(port, ws_new, ws_header_read, ws_free);
 }
+
+int websocket_http_init_unix(const char *path)
+{
+	return socket_listen_unix(path, ws_new, ws_header_read, ws_free);
+}
@@ -2,5 +2,7 @@
 #define WEBSOCKET_HTTP_H
 
 int websocket_http_init(unsigned port);
+/* Listens on a Unix domain socket, see socket_listen_unix. */
+int websocket_http_init_unix(const char *path);
 
 #endif